@@ -891,9 +891,10 @@ ssize_t Rio_readn(int fd, void *ptr, size_t nbytes)
     return n;
 }
 
+/* A peer that has gone away is not fatal: its next read sees the end */
 void Rio_writen(int fd, void *usrbuf, size_t n) 
 {
-    if (rio_writen(fd, usrbuf, n) != n)
+    if (rio_writen(fd, usrbuf, n) != n && errno != EPIPE && errno != ECONNRESET)
 	unix_error("Rio_writen error");
 }
 
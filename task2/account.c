@@ -0,0 +1,292 @@
+/*
+ * account.c - client accounts, see account.h
+ *
+ * Each shard is a linear-probing table that doubles at 3/4 load, allocated on
+ * the shard's first account. A slot is one cache line holding the account and
+ * its first INLINE_POS positions, so a trader with a handful of positions is
+ * checked and updated without touching a second line.
+ */
+#include "account.h"
+#include "proto.h"
+
+#define INLINE_POS 4       // Positions kept in the slot itself
+#define SHARD_INIT 1024    // Slots of a shard at its first account, a power of two
+
+typedef struct {
+	int stock_idx;
+	int qty;
+} position_t;
+
+typedef struct {
+	int account_id;              // 0 marks a free slot
+	int npos;                    // Positions held, the first INLINE_POS in pos and the rest in more
+	long long cash;
+	position_t pos[INLINE_POS];
+	position_t* more;            // NULL until an account holds more than INLINE_POS positions
+	int more_cap;
+} __attribute__((aligned(64))) account_t;
+
+typedef struct {
+	pthread_mutex_t lock;        // Protects the table and every account in it
+	account_t* slots;            // NULL until the shard's first account
+	unsigned int mask;           // Slots - 1
+	int n;                       // Accounts in the shard
+} __attribute__((aligned(64))) shard_t;
+
+static shard_t shards[ACCOUNT_SHARDS];
+
+// Fibonacci hashing: the low bits pick the shard and the high half the slot
+static unsigned long long hash(int account_id)
+{
+	return (unsigned int)account_id * 0x9E3779B97F4A7C15ULL;
+}
+
+static shard_t* shard_of(unsigned long long h)
+{
+	return &shards[h & (ACCOUNT_SHARDS - 1)];
+}
+
+static account_t* alloc_slots(unsigned int n)
+{
+	void* p = NULL;
+
+	if (posix_memalign(&p, 64, n * sizeof(account_t)) != 0)
+		unix_error("posix_memalign error");
+	memset(p, 0, n * sizeof(account_t));
+	return (account_t*)p;
+}
+
+// The account's slot, or the free slot where it would go
+static account_t* probe(shard_t* s, int account_id, unsigned long long h)
+{
+	unsigned int i = (h >> 32) & s->mask;
+
+	while (s->slots[i].account_id != account_id && s->slots[i].account_id != 0)
+		i = (i + 1) & s->mask;
+	return &s->slots[i];
+}
+
+static account_t* find(shard_t* s, int account_id, unsigned long long h)
+{
+	account_t* a;
+
+	if (s->slots == NULL)
+		return NULL;
+	a = probe(s, account_id, h);
+	return a->account_id ? a : NULL;
+}
+
+static void grow(shard_t* s)
+{
+	account_t* old = s->slots;
+	unsigned int i, n = s->mask + 1;
+
+	s->slots = alloc_slots(n * 2);
+	s->mask = n * 2 - 1;
+	for (i = 0; i < n; i++)
+		if (old[i].account_id)
+			*probe(s, old[i].account_id, hash(old[i].account_id)) = old[i];
+	Free(old);
+}
+
+static position_t* position_at(account_t* a, int i)
+{
+	return i < INLINE_POS ? &a->pos[i] : &a->more[i - INLINE_POS];
+}
+
+// The account's position in stock_idx; with create, a new empty one if it has none
+static position_t* position(account_t* a, int stock_idx, int create)
+{
+	position_t* p;
+	int i;
+
+	for (i = 0; i < a->npos; i++)
+		if ((p = position_at(a, i))->stock_idx == stock_idx)
+			return p;
+	if (!create)
+		return NULL;
+	if (a->npos >= INLINE_POS && a->npos - INLINE_POS == a->more_cap)
+		a->more = Realloc(a->more, sizeof(position_t) * (a->more_cap = a->more_cap * 2 + INLINE_POS));
+	p = position_at(a, a->npos++);
+	p->stock_idx = stock_idx;
+	p->qty = 0;
+	return p;
+}
+
+void account_init()
+{
+	int i;
+
+	for (i = 0; i < ACCOUNT_SHARDS; i++)
+	{
+		pthread_mutex_init(&shards[i].lock, NULL);
+		shards[i].slots = NULL;
+		shards[i].mask = 0;
+		shards[i].n = 0;
+	}
+}
+
+void account_free()
+{
+	unsigned int i, k;
+
+	for (i = 0; i < ACCOUNT_SHARDS; i++)
+	{
+		shard_t* s = &shards[i];
+
+		if (s->slots == NULL)
+			continue;
+		for (k = 0; k <= s->mask; k++)
+			if (s->slots[k].more)
+				Free(s->slots[k].more);
+		Free(s->slots);
+		s->slots = NULL;
+	}
+}
+
+long account_count()
+{
+	long n = 0;
+	int i;
+
+	for (i = 0; i < ACCOUNT_SHARDS; i++)
+		n += __atomic_load_n(&shards[i].n, __ATOMIC_RELAXED);
+	return n;
+}
+
+// Create the account with no cash and no positions, unless it exists.
+// Returns RESULT_INVALID if account_id is not positive.
+int account_open(int account_id)
+{
+	unsigned long long h = hash(account_id);
+	shard_t* s = shard_of(h);
+	account_t* a;
+
+	if (account_id <= 0)
+		return RESULT_INVALID;
+	pthread_mutex_lock(&s->lock);
+	if (s->slots == NULL)
+	{
+		s->slots = alloc_slots(SHARD_INIT);
+		s->mask = SHARD_INIT - 1;
+	}
+	if ((a = probe(s, account_id, h))->account_id == 0)
+	{
+		if ((s->n + 1) * 4 > (s->mask + 1) * 3)
+		{
+			grow(s);
+			a = probe(s, account_id, h);
+		}
+		a->account_id = account_id;
+		__atomic_store_n(&s->n, s->n + 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return RESULT_OK;
+}
+
+// Check the n legs against the account in order, each as if the legs before
+// it had been applied, and if apply is set and every leg passes, apply them
+// all. Returns RESULT_OK, or the RESULT_* of the first leg that fails with
+// *failed set to its index: RESULT_NO_CASH, RESULT_NO_POSITION, or
+// RESULT_INVALID for leg 0 if there is no such account.
+int account_apply(int account_id, account_leg_t* legs, int n, int apply, int* failed)
+{
+	unsigned long long h = hash(account_id);
+	shard_t* s = shard_of(h);
+	account_t* a;
+	position_t* p;
+	long long cash;
+	int i, k, qty, result = RESULT_OK;
+
+	*failed = -1;
+	pthread_mutex_lock(&s->lock);
+	if ((a = find(s, account_id, h)) == NULL)
+	{
+		pthread_mutex_unlock(&s->lock);
+		*failed = 0;
+		return RESULT_INVALID;
+	}
+	cash = a->cash;
+	for (i = 0; i < n; i++)
+	{
+		cash += legs[i].cash;
+		if (cash < 0)
+			result = RESULT_NO_CASH;
+		else if (legs[i].qty < 0)
+		{
+			qty = (p = position(a, legs[i].stock_idx, 0)) ? p->qty : 0;
+			for (k = 0; k <= i; k++)
+				if (legs[k].stock_idx == legs[i].stock_idx)
+					qty += legs[k].qty;
+			if (qty < 0)
+				result = RESULT_NO_POSITION;
+		}
+		if (result != RESULT_OK)
+		{
+			*failed = i;
+			break;
+		}
+	}
+	if (result == RESULT_OK && apply)
+	{
+		a->cash = cash;
+		for (i = 0; i < n; i++)
+		{
+			if (legs[i].qty == 0)
+				continue;
+			p = position(a, legs[i].stock_idx, 1);
+			if ((p->qty += legs[i].qty) == 0)   // Closed: the last position takes its place
+				*p = *position_at(a, --a->npos);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return result;
+}
+
+// Read the account's cash and pass each of its positions to fn, which runs
+// under the shard lock. Returns RESULT_INVALID if there is no such account.
+int account_get(int account_id, long long* cash, account_position_t* fn, void* arg)
+{
+	unsigned long long h = hash(account_id);
+	shard_t* s = shard_of(h);
+	account_t* a;
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	if ((a = find(s, account_id, h)) == NULL)
+	{
+		pthread_mutex_unlock(&s->lock);
+		return RESULT_INVALID;
+	}
+	*cash = a->cash;
+	for (i = 0; fn && i < a->npos; i++)
+		fn(arg, position_at(a, i)->stock_idx, position_at(a, i)->qty);
+	pthread_mutex_unlock(&s->lock);
+	return RESULT_OK;
+}
+
+// Pass every account to fn, followed by each of its positions to pos_fn, one
+// shard at a time under its lock
+void account_each(void (*fn)(void* arg, int account_id, long long cash), account_position_t* pos_fn, void* arg)
+{
+	unsigned int i, k;
+	int j;
+
+	for (i = 0; i < ACCOUNT_SHARDS; i++)
+	{
+		shard_t* s = &shards[i];
+
+		pthread_mutex_lock(&s->lock);
+		for (k = 0; s->slots && k <= s->mask; k++)
+		{
+			account_t* a = &s->slots[k];
+
+			if (a->account_id == 0)
+				continue;
+			fn(arg, a->account_id, a->cash);
+			for (j = 0; j < a->npos; j++)
+				pos_fn(arg, position_at(a, j)->stock_idx, position_at(a, j)->qty);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
@@ -0,0 +1,37 @@
+/*
+ * account.h - client accounts: cash and positions, hash-indexed and sharded
+ *
+ * Accounts are spread over ACCOUNT_SHARDS shards by a hash of account_id. A
+ * shard is an open-addressing table of cache-line-sized slots under its own
+ * lock, so orders of different accounts seldom meet on a lock or a line.
+ *
+ * The engine calls account_apply() with the writer lock of every instrument
+ * involved already held, or from the sequencer that owns them. Shard locks are
+ * only ever taken inside instrument locks and never two at a time, so the two
+ * kinds of lock cannot deadlock.
+ */
+#ifndef __ACCOUNT_H__
+#define __ACCOUNT_H__
+
+#include "csapp.h"
+
+#define ACCOUNT_SHARDS 64    // A power of two
+
+typedef struct {
+	int stock_idx;
+	int qty;             // Signed change of the position: bought is positive, sold negative
+	long long cash;      // Signed change of the cash
+} account_leg_t;
+
+// Called by account_each() for every position of an account
+typedef void account_position_t(void* arg, int stock_idx, int qty);
+
+void account_init();
+void account_free();
+long account_count();
+int account_open(int account_id);
+int account_apply(int account_id, account_leg_t* legs, int n, int apply, int* failed);
+int account_get(int account_id, long long* cash, account_position_t* fn, void* arg);
+void account_each(void (*fn)(void* arg, int account_id, long long cash), account_position_t* pos_fn, void* arg);
+
+#endif /* __ACCOUNT_H__ */
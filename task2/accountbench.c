@@ -0,0 +1,126 @@
+/*
+ * accountbench.c - order throughput with and without account checks
+ *
+ * usage: accountbench [--accounts=N] [--threads=T] [--orders=N] [--engine=locked|sequencer]
+ *
+ * Runs the engine in this process on stock.txt of the working directory, which
+ * is never written back. Stocks every instrument and opens --accounts accounts
+ * (1000000 by default) with enough cash to never run out, so only the checks
+ * are measured and not rejections. Then T threads send round trips of a buy
+ * and a sell of the same random instrument: first for ACCOUNT_NONE, the
+ * unchecked path, then each round trip for a random account. Reports orders
+ * per second of both and their ratio.
+ */
+#include "csapp.h"
+#include "engine.h"
+#include <time.h>
+
+int accounts = 1000000;
+int nthreads = 4;
+long orders = 4000000;      // Over all threads, half of them buys
+int with_accounts = 0;      // Phase being run
+long rejected = 0;
+
+long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+unsigned int next_rand(unsigned int* s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 17;
+	*s ^= *s << 5;
+	return *s;
+}
+
+void* client(void* vargp)
+{
+	unsigned int seed = (unsigned int)(long)vargp * 2654435761u + 1;
+	engine_stock_t s;
+	long i, bad = 0;
+
+	for (i = 0; i < orders / nthreads / 2; i++)
+	{
+		int account_id = with_accounts ? next_rand(&seed) % accounts + 1 : ACCOUNT_NONE;
+		int qty = next_rand(&seed) % 10 + 1;
+
+		engine_stock(next_rand(&seed) % engine_count(), &s);
+		if (engine_buy(account_id, s.stock_id, qty) != RESULT_OK)
+			bad++;
+		else if (engine_sell(account_id, s.stock_id, qty) != RESULT_OK)
+			bad++;
+	}
+	__atomic_add_fetch(&rejected, bad, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+// Orders per second of one phase
+double run()
+{
+	pthread_t* tids = Malloc(sizeof(pthread_t) * nthreads);
+	long i, start = now_ns();
+
+	rejected = 0;
+	for (i = 0; i < nthreads; i++)
+		Pthread_create(&tids[i], NULL, client, (void*)i);
+	for (i = 0; i < nthreads; i++)
+		Pthread_join(tids[i], NULL);
+	Free(tids);
+	return (double)(orders / nthreads / 2 * 2 * nthreads) / ((now_ns() - start) / 1e9);
+}
+
+int main(int argc, char** argv)
+{
+	engine_config_t config = { PERSIST_REWRITE, DURABILITY_MEMORY, ENGINE_LOCKED, 4, NULL, NULL };
+	double unchecked, checked;
+	engine_stock_t s;
+	long long cash;
+	long i, start;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strncmp(argv[i], "--accounts=", 11))
+			accounts = atoi(argv[i] + 11);
+		else if (!strncmp(argv[i], "--threads=", 10))
+			nthreads = atoi(argv[i] + 10);
+		else if (!strncmp(argv[i], "--orders=", 9))
+			orders = atol(argv[i] + 9);
+		else if (!strcmp(argv[i], "--engine=locked"))
+			config.mode = ENGINE_LOCKED;
+		else if (!strcmp(argv[i], "--engine=sequencer"))
+			config.mode = ENGINE_SEQUENCER;
+		else
+		{
+			fprintf(stderr, "usage: %s [--accounts=N] [--threads=T] [--orders=N] [--engine=locked|sequencer]\n", argv[0]);
+			exit(0);
+		}
+	}
+	if (accounts < 1 || nthreads < 1)
+		app_error("--accounts and --threads must be positive");
+	engine_open(&config);
+
+	for (i = 0; i < engine_count(); i++)
+	{
+		engine_stock(i, &s);
+		engine_sell(ACCOUNT_NONE, s.stock_id, 100000000);
+	}
+	start = now_ns();
+	for (i = 1; i <= accounts; i++)
+	{
+		engine_account(i);
+		engine_deposit(i, 1000000000000LL, &cash);
+	}
+	printf("%d accounts opened in %.3f s\n", accounts, (now_ns() - start) / 1e9);
+
+	unchecked = run();
+	printf("unchecked: %.0f orders/s, %ld rejected\n", unchecked, rejected);
+	with_accounts = 1;
+	checked = run();
+	printf("accounts:  %.0f orders/s, %ld rejected, %.2fx the unchecked time per order\n", checked, rejected, unchecked / checked);
+	engine_close();
+	return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ * basketbench.c - contention benchmark for multi-leg orders
+ *
+ * Each client thread repeatedly buys a basket of --legs=K distinct instruments
+ * out of the first stock# and then sells it back. Overlapping baskets compete
+ * for the same left_stock, so buys fail under contention. Two ways to get a
+ * basket are compared:
+ *
+ *   --retry   (default) the client buys leg by leg; when a leg fails it sells
+ *             back the legs it already holds and starts over
+ *   --multi   the client sends one "multi K" order that the server applies all
+ *             or none, and simply resends it when it fails
+ *
+ * Run the server on a store where left_stock is a small multiple of --qty, so
+ * that only a few baskets fit at a time.
+ */
+#include "csapp.h"
+#include <time.h>
+
+#define LEGS_MAX 16
+
+char* host;
+char* port;
+int basket_num;          // Baskets per client
+int stock_num = 5;       // Baskets pick stock_id 1..stock_num
+int legs = 2;            // Instruments per basket
+int qty = 5;             // Quantity of every leg
+int use_multi = 0;       // Atomic multi-leg orders instead of client-side retries
+long attempts = 0;       // Tries to get a basket, over all clients
+long round_trips = 0;    // Requests that waited for a reply, over all clients
+long* latency;           // Time to get and release each basket in ns, client i owns [i * basket_num, (i + 1) * basket_num)
+
+long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Send one request and read its one-line reply into buf
+void request(int fd, rio_t* rio, char* req, int len, char* buf, long* trips)
+{
+	Rio_writen(fd, req, len);
+	if (Rio_readlineb(rio, buf, MAXLINE) == 0)
+		app_error("server closed the connection");
+	(*trips)++;
+}
+
+// Send one multi-leg order of the given verb over every instrument in ids
+int multi_order(int fd, rio_t* rio, const char* verb, int* ids, char* buf, long* trips)
+{
+	char req[MAXLINE];
+	int j, len = sprintf(req, "multi %d\n", legs);
+
+	for (j = 0; j < legs; j++)
+		len += sprintf(req + len, "%s %d %d\n", verb, ids[j], qty);
+	request(fd, rio, req, len, buf, trips);
+	return !strcmp(buf, "[multi] success\n");
+}
+
+// Sell back the first n legs one at a time
+void sell_legs(int fd, rio_t* rio, int* ids, int n, char* buf, long* trips)
+{
+	char req[64];
+	int j;
+
+	for (j = 0; j < n; j++)
+		request(fd, rio, req, sprintf(req, "sell %d %d\n", ids[j], qty), buf, trips);
+}
+
+void* client(void* vargp)
+{
+	long id = (long)vargp;
+	unsigned int seed = (unsigned int)id + 1;
+	char buf[MAXLINE], req[64];
+	int ids[LEGS_MAX];
+	rio_t rio;
+	long tries = 0, trips = 0;
+	int i, j, k, clientfd = Open_clientfd(host, port);
+
+	Rio_readinitb(&rio, clientfd);
+	for (i = 0; i < basket_num; i++)
+	{
+		long start = now_ns();
+
+		for (j = 0; j < legs; j++)   // Distinct instruments
+		{
+			do
+			{
+				ids[j] = rand_r(&seed) % stock_num + 1;
+				for (k = 0; k < j && ids[k] != ids[j]; k++)
+					;
+			} while (k < j);
+		}
+
+		if (use_multi)
+		{
+			do
+				tries++;
+			while (!multi_order(clientfd, &rio, "buy", ids, buf, &trips));
+			multi_order(clientfd, &rio, "sell", ids, buf, &trips);
+		}
+		else
+		{
+			do
+			{
+				tries++;
+				for (j = 0; j < legs; j++)
+				{
+					request(clientfd, &rio, req, sprintf(req, "buy %d %d\n", ids[j], qty), buf, &trips);
+					if (strcmp(buf, "[buy] success\n"))
+						break;
+				}
+				if (j < legs)
+					sell_legs(clientfd, &rio, ids, j, buf, &trips);   // Undo the partial basket
+			} while (j < legs);
+			sell_legs(clientfd, &rio, ids, legs, buf, &trips);
+		}
+		latency[id * basket_num + i] = now_ns() - start;
+	}
+	__atomic_add_fetch(&attempts, tries, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&round_trips, trips, __ATOMIC_RELAXED);
+	Close(clientfd);
+	return NULL;
+}
+
+int long_less(const void* a, const void* b)
+{
+	long x = *(long*)a, y = *(long*)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char** argv)
+{
+	int i, num_client;
+	long start, elapsed, total;
+	pthread_t* tids;
+
+	if (argc < 5)
+	{
+		fprintf(stderr, "usage: %s <host> <port> <client#> <basket#> [stock#] [--legs=K] [--qty=N] [--multi|--retry]\n", argv[0]);
+		exit(0);
+	}
+	host = argv[1];
+	port = argv[2];
+	num_client = atoi(argv[3]);
+	basket_num = atoi(argv[4]);
+	for (i = 5; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--multi"))
+			use_multi = 1;
+		else if (!strcmp(argv[i], "--retry"))
+			use_multi = 0;
+		else if (!strncmp(argv[i], "--legs=", 7))
+			legs = atoi(argv[i] + 7);
+		else if (!strncmp(argv[i], "--qty=", 6))
+			qty = atoi(argv[i] + 6);
+		else
+			stock_num = atoi(argv[i]);
+	}
+	if (legs < 1 || legs > LEGS_MAX || legs > stock_num)
+		app_error("--legs=K needs 1 <= K <= 16 and K <= stock#");
+	total = (long)num_client * basket_num;
+	latency = Malloc(sizeof(long) * total);
+	tids = Malloc(sizeof(pthread_t) * num_client);
+
+	start = now_ns();
+	for (i = 0; i < num_client; i++)
+		Pthread_create(&tids[i], NULL, client, (void*)(long)i);
+	for (i = 0; i < num_client; i++)
+		Pthread_join(tids[i], NULL);
+	elapsed = now_ns() - start;
+
+	qsort(latency, total, sizeof(long), long_less);
+	printf("%s: %ld baskets in %.3f s: %.0f baskets/s, %.2f attempts/basket, %.1f round trips/basket, p50 %.1f us, p99 %.1f us\n",
+		use_multi ? "multi" : "retry", total, elapsed / 1e9, total / (elapsed / 1e9), (double)attempts / total,
+		(double)round_trips / total, latency[total / 2] / 1e3, latency[total * 99 / 100] / 1e3);
+
+	Free(tids);
+	Free(latency);
+	return 0;
+}
@@ -0,0 +1,263 @@
+/*
+ * book.c - price-time priority limit order book of one instrument
+ *
+ * Price levels live in one array indexed by price, so finding the level of an
+ * order is an index and walking to the next best price touches neighbouring
+ * cache lines. Orders live in a pool and are chained into their level's FIFO
+ * by pool index, both ways, so adding at the tail, filling at the head and
+ * cancelling from the middle are all O(1). The only walk is moving the best
+ * price on once a level empties, which is short while the book is dense
+ * around the touch.
+ */
+#include "book.h"
+
+#define LEVELS_MIN 1024     // Price levels allocated at first
+#define ORDERS_MIN 1024     // Pool slots allocated at first
+#define ID_SLOT(id) ((unsigned int)((id) & 0xffffffffLL))
+
+static void grow_orders(book_t* b)
+{
+	int i, cap = b->cap ? b->cap * 2 : ORDERS_MIN;
+
+	b->orders = Realloc(b->orders, sizeof(book_order_t) * cap);
+	for (i = b->cap; i < cap; i++)
+	{
+		b->orders[i].id = 0;
+		b->orders[i].next = i + 1 < cap ? i + 1 : b->free_head;
+	}
+	b->free_head = b->cap;
+	b->cap = cap;
+}
+
+// The levels would still span at most BOOK_SPAN prices with price among them
+static int fits(book_t* b, int price)
+{
+	int lo = price < b->base ? price : b->base;
+	int hi = price >= b->base + b->nlevels ? price : b->base + b->nlevels - 1;
+
+	return price > 0 && hi - lo < BOOK_SPAN;
+}
+
+// Make levels cover price, which fits, at least doubling them while within BOOK_SPAN
+static void cover(book_t* b, int price)
+{
+	int base = b->base, end = b->base + b->nlevels, i;
+
+	if (price >= base && price < end)
+		return;
+	if (price < base)
+	{
+		base = price - b->nlevels;
+		if (base < end - BOOK_SPAN)
+			base = end - BOOK_SPAN;
+		if (base < 1)
+			base = 1;
+	}
+	else
+	{
+		end = price + b->nlevels;
+		if (end > base + BOOK_SPAN)
+			end = base + BOOK_SPAN;
+	}
+
+	b->levels = Realloc(b->levels, sizeof(book_level_t) * (end - base));
+	memmove(b->levels + (b->base - base), b->levels, sizeof(book_level_t) * b->nlevels);
+	for (i = base; i < end; i++)
+		if (i < b->base || i >= b->base + b->nlevels)
+		{
+			b->levels[i - base].head = b->levels[i - base].tail = BOOK_NONE;
+			b->levels[i - base].qty = 0;
+		}
+	b->base = base;
+	b->nlevels = end - base;
+}
+
+// Allocate a book whose first levels are centred on price_hint
+book_t* book_new(int price_hint)
+{
+	book_t* b = Calloc(1, sizeof(book_t));
+	int i;
+
+	b->base = price_hint > LEVELS_MIN / 2 ? price_hint - LEVELS_MIN / 2 : 1;
+	b->nlevels = LEVELS_MIN;
+	b->levels = Malloc(sizeof(book_level_t) * LEVELS_MIN);
+	for (i = 0; i < LEVELS_MIN; i++)
+	{
+		b->levels[i].head = b->levels[i].tail = BOOK_NONE;
+		b->levels[i].qty = 0;
+	}
+	b->free_head = BOOK_NONE;
+	grow_orders(b);
+	return b;
+}
+
+void book_free(book_t* b)
+{
+	Free(b->levels);
+	Free(b->orders);
+	Free(b);
+}
+
+// The best price of side once the level at price has emptied, 0 if none rests
+static int next_best(book_t* b, int side, int price)
+{
+	int step = side == SIDE_BID ? -1 : 1;
+
+	if (b->resting[side] == 0)
+		return 0;
+	do
+		price += step;
+	while (b->levels[price - b->base].head == BOOK_NONE);   // One rests somewhere beyond
+	return price;
+}
+
+// Remove slot o from its level and return it to the pool
+static void unlink_order(book_t* b, int o)
+{
+	book_order_t* ord = &b->orders[o];
+	book_level_t* l = &b->levels[ord->price - b->base];
+
+	if (ord->prev == BOOK_NONE)
+		l->head = ord->next;
+	else
+		b->orders[ord->prev].next = ord->next;
+	if (ord->next == BOOK_NONE)
+		l->tail = ord->prev;
+	else
+		b->orders[ord->next].prev = ord->prev;
+	l->qty -= ord->qty;
+	b->resting[ord->side]--;
+
+	ord->id = 0;
+	ord->next = b->free_head;
+	b->free_head = o;
+}
+
+// Fill up to qty against the level at price, oldest order first. Returns the quantity filled.
+static int match_level(book_t* b, int price, int qty, book_fill_t* fill, void* arg)
+{
+	book_level_t* l = &b->levels[price - b->base];
+	int filled = 0;
+
+	while (filled < qty && l->head != BOOK_NONE)
+	{
+		book_order_t* maker = &b->orders[l->head];
+		int n = qty - filled < maker->qty ? qty - filled : maker->qty;
+
+		if (fill)
+			fill(arg, maker->id, price, n);
+		maker->qty -= n;
+		l->qty -= n;
+		filled += n;
+		if (maker->qty == 0)
+			unlink_order(b, l->head);
+	}
+	b->last_price = price;
+	return filled;
+}
+
+// Match a limit order of qty at price against the other side, then rest what
+// is left. fill is called for every fill, under whatever lock guards b.
+// Returns the quantity left resting, whose order id is stored in *id (0 if
+// nothing rests), or -1 with nothing done if price is out of range or qty is
+// not positive.
+int book_add(book_t* b, int side, int price, int qty, long long* id, book_fill_t* fill, void* arg)
+{
+	book_order_t* ord;
+	book_level_t* l;
+	int o;
+
+	if (qty <= 0 || !fits(b, price))
+		return -1;
+	if (side == SIDE_BID)
+		while (qty > 0 && b->best_ask && b->best_ask <= price)
+		{
+			qty -= match_level(b, b->best_ask, qty, fill, arg);
+			if (b->levels[b->best_ask - b->base].head == BOOK_NONE)
+				b->best_ask = next_best(b, SIDE_ASK, b->best_ask);
+		}
+	else
+		while (qty > 0 && b->best_bid && b->best_bid >= price)
+		{
+			qty -= match_level(b, b->best_bid, qty, fill, arg);
+			if (b->levels[b->best_bid - b->base].head == BOOK_NONE)
+				b->best_bid = next_best(b, SIDE_BID, b->best_bid);
+		}
+
+	*id = 0;
+	if (qty == 0)
+		return 0;
+
+	cover(b, price);
+	if (b->free_head == BOOK_NONE)
+		grow_orders(b);
+	o = b->free_head;
+	ord = &b->orders[o];
+	b->free_head = ord->next;
+	if (++b->gen > 0x7fffffff)   // Keeps ids positive
+		b->gen = 1;
+	ord->id = *id = (long long)b->gen << 32 | o;
+	ord->price = price;
+	ord->qty = qty;
+	ord->side = side;
+
+	l = &b->levels[price - b->base];
+	ord->prev = l->tail;
+	ord->next = BOOK_NONE;
+	if (l->tail == BOOK_NONE)
+		l->head = o;
+	else
+		b->orders[l->tail].next = o;
+	l->tail = o;
+	l->qty += qty;
+	b->resting[side]++;
+
+	if (side == SIDE_BID && price > b->best_bid)
+		b->best_bid = price;
+	if (side == SIDE_ASK && (b->best_ask == 0 || price < b->best_ask))
+		b->best_ask = price;
+	return qty;
+}
+
+// Cancel the resting order id. Returns the quantity it still had, or -1 if
+// no such order rests.
+int book_cancel(book_t* b, long long id)
+{
+	unsigned int o = ID_SLOT(id);
+	int price, side, qty;
+
+	if (id <= 0 || o >= (unsigned int)b->cap || b->orders[o].id != id)
+		return -1;
+	price = b->orders[o].price;
+	side = b->orders[o].side;
+	qty = b->orders[o].qty;
+	unlink_order(b, o);
+	if (b->levels[price - b->base].head == BOOK_NONE)
+	{
+		if (side == SIDE_BID && price == b->best_bid)
+			b->best_bid = next_best(b, SIDE_BID, price);
+		if (side == SIDE_ASK && price == b->best_ask)
+			b->best_ask = next_best(b, SIDE_ASK, price);
+	}
+	return qty;
+}
+
+// Store up to max of the best levels of side, best first. Returns how many.
+int book_depth(book_t* b, int side, int* prices, long long* qtys, int max)
+{
+	int price = side == SIDE_BID ? b->best_bid : b->best_ask;
+	int step = side == SIDE_BID ? -1 : 1, n = 0;
+
+	if (price == 0)
+		return 0;
+	for (; n < max && price >= b->base && price < b->base + b->nlevels; price += step)   // Beyond the best, only this side rests
+	{
+		book_level_t* l = &b->levels[price - b->base];
+
+		if (l->head == BOOK_NONE)
+			continue;
+		prices[n] = price;
+		qtys[n++] = l->qty;
+	}
+	return n;
+}
@@ -0,0 +1,53 @@
+/*
+ * book.h - price-time priority limit order book of one instrument
+ */
+#ifndef __BOOK_H__
+#define __BOOK_H__
+
+#include "csapp.h"
+
+#define SIDE_BID 0
+#define SIDE_ASK 1
+
+#define BOOK_NONE -1           // End of a FIFO or of the free list
+#define BOOK_SPAN 1048576      // Most prices one book's levels may cover
+
+typedef struct {
+	long long id;              // Order id handed to the client, 0 while the slot is free
+	int price;
+	int qty;                   // Quantity still resting
+	int side;                  // SIDE_BID or SIDE_ASK
+	int prev, next;            // Neighbours in the level's FIFO; next also links the free list
+} book_order_t;
+
+// A price level. Bids and asks never rest at the same price (they would have
+// matched), so one array of levels serves both sides.
+typedef struct {
+	int head, tail;            // Oldest and newest order at this price, BOOK_NONE if empty
+	long long qty;             // Total quantity resting here
+} book_level_t;
+
+typedef struct {
+	int base;                  // Price of levels[0]
+	int nlevels;
+	book_level_t* levels;      // Dense by price: levels[price - base]
+	int best_bid;              // Highest price with a resting bid, 0 if none
+	int best_ask;              // Lowest price with a resting ask, 0 if none
+	int resting[2];            // Resting orders per side
+	book_order_t* orders;      // Order pool, indexed by the low half of an order id
+	int cap;
+	int free_head;             // First free slot in orders
+	unsigned int gen;          // Makes ids of reused slots differ
+	int last_price;            // Price of the last fill, 0 before the first
+} book_t;
+
+// Called once per fill with the resting order it traded against
+typedef void book_fill_t(void* arg, long long maker_id, int price, int qty);
+
+book_t* book_new(int price_hint);
+void book_free(book_t* b);
+int book_add(book_t* b, int side, int price, int qty, long long* id, book_fill_t* fill, void* arg);
+int book_cancel(book_t* b, long long id);
+int book_depth(book_t* b, int side, int* prices, long long* qtys, int max);
+
+#endif /* __BOOK_H__ */
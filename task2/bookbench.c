@@ -0,0 +1,130 @@
+/*
+ * bookbench.c - sustained throughput of one order book on one core
+ *
+ * usage: bookbench [--ops=N] [--seed=N]
+ *
+ * Replays a pregenerated flow around a drifting mid price: passive orders a
+ * few ticks off the touch, cancels, and marketable orders that sweep one or
+ * more levels. Each of LIVE traders keeps at most one order working, so the
+ * book stays at a steady size. Reports operations and fills per second.
+ */
+#include "csapp.h"
+#include "book.h"
+#include <time.h>
+
+#define LIVE 65536       // Working order slots, at most one resting order each
+
+#define OP_PASSIVE 0
+#define OP_CANCEL  1
+#define OP_TAKER   2
+
+typedef struct {
+	int op;
+	int side;
+	int price;
+	int qty;
+	int slot;        // Working order slot: a cancel pulls its order, a new order replaces it
+} op_t;
+
+long fills = 0;
+
+long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+unsigned int next_rand(unsigned int* s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 17;
+	*s ^= *s << 5;
+	return *s;
+}
+
+void count_fill(void* arg, long long maker_id, int price, int qty)
+{
+	fills++;
+}
+
+int main(int argc, char** argv)
+{
+	static long long live[LIVE];
+	long i, nops = 10000000, start, elapsed, cancelled = 0, takers = 0;
+	unsigned int seed = 1;
+	int mid = 10000, resting;
+	op_t* ops;
+	book_t* b;
+	long long id;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strncmp(argv[i], "--ops=", 6))
+			nops = atol(argv[i] + 6);
+		else if (!strncmp(argv[i], "--seed=", 7))
+			seed = atoi(argv[i] + 7) | 1;
+		else
+		{
+			fprintf(stderr, "usage: %s [--ops=N] [--seed=N]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	ops = Malloc(sizeof(op_t) * nops);
+	for (i = 0; i < nops; i++)
+	{
+		unsigned int r = next_rand(&seed) % 100;
+		op_t* o = &ops[i];
+
+		if (i % 1000 == 0)
+			mid += (int)(next_rand(&seed) % 3) - 1;
+		o->side = next_rand(&seed) & 1;
+		o->slot = next_rand(&seed) % LIVE;
+		if (r < 45)   // Rests 1 to 20 ticks behind the touch
+		{
+			o->op = OP_PASSIVE;
+			o->price = mid + (o->side == SIDE_BID ? -1 : 1) * (1 + (int)(next_rand(&seed) % 20));
+			o->qty = 1 + next_rand(&seed) % 100;
+		}
+		else if (r < 85)
+			o->op = OP_CANCEL;
+		else          // Crosses up to 5 ticks through the mid
+		{
+			o->op = OP_TAKER;
+			o->price = mid + (o->side == SIDE_BID ? 1 : -1) * (int)(next_rand(&seed) % 6);
+			o->qty = 1 + next_rand(&seed) % 200;
+		}
+	}
+
+	b = book_new(mid);
+	start = now_ns();
+	for (i = 0; i < nops; i++)
+	{
+		op_t* o = &ops[i];
+
+		if (o->op == OP_CANCEL)
+		{
+			if (live[o->slot] && book_cancel(b, live[o->slot]) >= 0)
+				cancelled++;
+			live[o->slot] = 0;
+			continue;
+		}
+		takers += o->op == OP_TAKER;
+		if (live[o->slot] && book_cancel(b, live[o->slot]) >= 0)
+			cancelled++;
+		live[o->slot] = 0;
+		if (book_add(b, o->side, o->price, o->qty, &id, count_fill, NULL) > 0)
+			live[o->slot] = id;
+	}
+	elapsed = now_ns() - start;
+
+	resting = b->resting[SIDE_BID] + b->resting[SIDE_ASK];
+	printf("%ld ops: %ld takers, %ld cancelled, %ld fills, %d resting at the end\n", nops, takers, cancelled, fills, resting);
+	printf("%.1f ns/op, %.2f M ops/s, %.2f M fills/s on one core\n",
+		(double)elapsed / nops, nops * 1e3 / elapsed, fills * 1e3 / elapsed);
+	book_free(b);
+	Free(ops);
+	return 0;
+}
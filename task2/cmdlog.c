@@ -0,0 +1,138 @@
+/*
+ * cmdlog.c - binary log of every command the server received, for replay
+ *
+ * Workers only copy a record into the active buffer under a mutex. A writer
+ * thread swaps buffers and writes the full one out, so a worker waits on the
+ * disk only when the active buffer fills up before the writer got to it.
+ */
+#include "csapp.h"
+#include "cmdlog.h"
+#include <time.h>
+
+#define CMDLOG_BUF (1 << 20)    // Bytes per buffer
+#define CMDLOG_MS  100          // The writer writes at least this often
+
+int cmdlog_on = 0;              // Selected with --record=PATH
+
+static int log_fd = -1;
+static long start_ns;
+static unsigned int next_conn = 0;
+static char* bufs[2];
+static int active = 0;          // Buffer records go into
+static int fill = 0;            // Bytes in bufs[active]
+static int writing = 0;         // The writer has the other buffer
+static int stopping = 0;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_kick = PTHREAD_COND_INITIALIZER;    // Wakes the writer
+static pthread_cond_t log_room = PTHREAD_COND_INITIALIZER;    // Wakes workers waiting for a buffer
+
+static long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Swap out the active buffer and write it, without log_mutex held during the write
+static void write_out()
+{
+	char* buf = bufs[active];
+	int len = fill;
+
+	active ^= 1;
+	fill = 0;
+	writing = 1;
+	pthread_mutex_unlock(&log_mutex);
+	Rio_writen(log_fd, buf, len);
+	pthread_mutex_lock(&log_mutex);
+	writing = 0;
+	pthread_cond_broadcast(&log_room);
+}
+
+static void* log_writer(void* vargp)
+{
+	struct timespec ts;
+
+	Pthread_detach(pthread_self());
+	pthread_mutex_lock(&log_mutex);
+	while (!stopping)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += CMDLOG_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&log_kick, &log_mutex, &ts);
+		if (fill > 0 && !writing)
+			write_out();
+	}
+	pthread_mutex_unlock(&log_mutex);
+	return NULL;
+}
+
+// Start recording to path, replacing whatever it held
+void cmdlog_open(const char* path)
+{
+	pthread_t tid;
+
+	log_fd = Open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	Rio_writen(log_fd, CMDLOG_MAGIC, strlen(CMDLOG_MAGIC));
+	bufs[0] = Malloc(CMDLOG_BUF);
+	bufs[1] = Malloc(CMDLOG_BUF);
+	start_ns = now_ns();
+	cmdlog_on = 1;
+	Pthread_create(&tid, NULL, log_writer, NULL);
+}
+
+// Id for a newly accepted connection
+unsigned int cmdlog_conn()
+{
+	return __atomic_add_fetch(&next_conn, 1, __ATOMIC_RELAXED);
+}
+
+// Log one line of len bytes received on conn, or with len 0 the end of conn
+void cmdlog_record(unsigned int conn, const char* line, int len)
+{
+	cmdlog_rec_t rec;
+
+	if (len > CMDLOG_BUF - sizeof(rec))
+		len = CMDLOG_BUF - sizeof(rec);
+	pthread_mutex_lock(&log_mutex);
+	while (fill + sizeof(rec) + len > CMDLOG_BUF && !stopping)
+	{
+		if (!writing)
+			write_out();
+		else
+			pthread_cond_wait(&log_room, &log_mutex);
+	}
+	if (!stopping)
+	{
+		rec.ns = htole64(now_ns() - start_ns);   // Taken under the mutex, so records are in time order
+		rec.conn = htole32(conn);
+		rec.len = htole32(len);
+		memcpy(bufs[active] + fill, &rec, sizeof(rec));
+		memcpy(bufs[active] + fill + sizeof(rec), line, len);
+		fill += sizeof(rec) + len;
+		if (fill > CMDLOG_BUF / 2)
+			pthread_cond_signal(&log_kick);
+	}
+	pthread_mutex_unlock(&log_mutex);
+}
+
+// Write out what is buffered and stop recording; called once at shutdown
+void cmdlog_close()
+{
+	pthread_mutex_lock(&log_mutex);
+	while (writing)
+		pthread_cond_wait(&log_room, &log_mutex);
+	stopping = 1;
+	pthread_cond_broadcast(&log_room);
+	pthread_cond_signal(&log_kick);
+	Rio_writen(log_fd, bufs[active], fill);
+	fill = 0;
+	pthread_mutex_unlock(&log_mutex);
+	Close(log_fd);
+}
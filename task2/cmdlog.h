@@ -0,0 +1,30 @@
+/*
+ * cmdlog.h - binary log of every command the server received, for replay
+ *
+ * The file starts with the 8 bytes CMDLOG_MAGIC, followed by one record per
+ * command line: a cmdlog_rec_t, then len bytes of the line as received. A
+ * record with len 0 marks the end of its connection. Integers are
+ * little-endian. Orders that arrived as binary frames are logged as the text
+ * line that means the same, so every log replays over the text protocol.
+ */
+#ifndef __CMDLOG_H__
+#define __CMDLOG_H__
+
+#include <stdint.h>
+
+#define CMDLOG_MAGIC "STKCMD01"
+
+typedef struct {
+	uint64_t ns;       // Time received, from the start of the recording
+	uint32_t conn;     // Connection id, from 1 in order of acceptance
+	uint32_t len;      // Bytes of the line that follow, 0 once the connection has ended
+} cmdlog_rec_t;
+
+extern int cmdlog_on;
+
+void cmdlog_open(const char* path);
+unsigned int cmdlog_conn();
+void cmdlog_record(unsigned int conn, const char* line, int len);
+void cmdlog_close();
+
+#endif /* __CMDLOG_H__ */
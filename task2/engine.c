@@ -0,0 +1,1654 @@
+/*
+ * engine.c - the stock store, its orders and its persistence, see engine.h
+ *
+ * Instruments live in a balanced binary search tree built once from stock.txt,
+ * also reachable by stock_idx. Readers and writers of a node follow the
+ * readers-writers protocol on its mutex and writer semaphores; in sequencer
+ * mode buys and sells instead run on the sequencer thread of the node's shard.
+ * Buys and sells of a hot node are combined, see combine(); in sequencer mode
+ * they can instead be netted over a window, see order_flush().
+ */
+#include "engine.h"
+#include "sequencer.h"
+#include <limits.h>
+
+typedef struct stock_item* stock_link;
+typedef struct stock_item {
+	int stock_id;           // Stock ID
+	int left_stock;         // Number of stocks left
+	int stock_price;        // Stock price
+	int stock_readcnt;      // Read count of the stock
+	int stock_idx;          // Position in stock_id order, also the record number in the fixed-width file
+	long long stock_seq;    // Change number of the last order that changed the stock, that of the open if none yet
+	book_t* book;           // Limit order book under the writer semaphore, NULL until the first bid or ask
+	int wait_ns;            // Moving average of the writer wait of buys and sells, see order_lock()
+	int hot;                // Buys and sells go through fc instead of queueing on the writer semaphore
+	struct combine* fc;     // Combining array, NULL until the stock first turns hot
+	int net;                // Sequencer engine, netting: change to left_stock by the open window's orders
+	int net_listed;         // On its shard's netting list, which order_flush() empties
+	long long net_ticket;   // Journal ticket of the window's update, for the orders it made final
+	stock_link net_next;    // Next stock on the netting list
+	sem_t mutex;            // Mutex semaphore for controlling access to the stock
+	sem_t writer;           // Writer semaphore for controlling write access to the stock
+	stock_link left;        // Pointer to the left child in the binary tree
+	stock_link right;       // Pointer to the right child in the binary tree
+	stock_link next;        // Pointer to the next stock item (temporary, used when creating a list)
+} STOCK_ITEM;
+
+static int total_stock_num = 0;    // Total number of stock items
+static STOCK_ITEM* stock_head = NULL;    // Pointer to the head of the stock list
+static STOCK_ITEM* stock_tail = NULL;    // Pointer to the tail of the stock list
+static STOCK_ITEM* root = NULL;    // Pointer to the root of the binary tree
+static STOCK_ITEM** stock_by_idx = NULL;    // Nodes indexed by stock_idx
+
+static sem_t file_mutex;    // Mutex semaphore for controlling access to the file
+
+#define RECORD_LEN 36        // Fixed-width record: "%11d %11d %11d\n", still readable by fscanf
+#define SHOW_LEN   36        // Longest "id left price\t" of a show reply: three ints, two spaces, a tab
+
+static engine_config_t cfg;               // As given to engine_open()
+static sem_t snapshot_req;                // Posted by engine_checkpoint() in fork mode, consumed by snapshot_thread
+static volatile pid_t snapshot_pid = 0;   // Snapshot child currently running, 0 if none
+static unsigned long* dirty_map = NULL;   // One bit per stock_idx, set by buy/sell and cleared by flush_dirty
+static int record_fd = -1;                // stock.txt opened for pwrite in pwrite mode
+static int journal_on = 0;                // Every order is appended to stock.journal.<seg> unless durability is memory
+
+#define CHANGE_LOG 65536      // Changes remembered for "show since"; an older cursor gets a full scan
+
+typedef struct {
+	long long seq;            // Change number, 0 while the slot is being written
+	int stock_idx;            // Stock it changed
+} change_t;
+
+// Change numbers of a run start at the wall clock in ns when it opened the
+// store. No run hands out a number per ns, so every cursor of an earlier run is
+// below the first number of this one, and engine_since() answers it in full.
+static long long change_seq = 0;               // Last change number handed out
+static change_t change_log[CHANGE_LOG];        // Change number seq lives in slot seq % CHANGE_LOG
+
+static sem_t multi_mutex;                      // Sequencer engine: one multi-leg order at a time parks the shards it spans
+static STOCK_ITEM** net_head = NULL;           // Sequencer engine, netting: per shard, the stocks the open window changed
+
+#define COMBINE_SLOTS  64      // Buys and sells of one hot instrument that can wait to be combined at once
+#define COMBINE_PASSES 4       // Scans of the array per lock hold, as long as they still find requests
+#define COMBINE_WINDOW 64      // Combining lock holds between checks whether the instrument is still hot
+#define COMBINE_OFF    2       // Requests per lock hold under which the instrument cools down
+#define COMBINE_SPIN   2000    // Polls of a published request before sleeping on the lock, with a CPU to spare
+
+#define SLOT_FREE    0
+#define SLOT_CLAIMED 1         // Being filled in by the thread that claimed it
+#define SLOT_PENDING 2         // Published, waiting for whoever holds the lock
+#define SLOT_DONE    3         // Applied, result and ticket filled in
+
+typedef struct {
+	int state;                 // SLOT_*
+	int side;
+	int stock_num;
+	int account_id;
+	int result;
+	long long ticket;
+} __attribute__((aligned(64))) combine_slot_t;
+
+typedef struct combine {
+	combine_slot_t slots[COMBINE_SLOTS];
+	int holds;                 // Combining lock holds since the last check, under the writer semaphore
+	int applied;               // Requests they applied
+} combine_t;
+
+static int combine_spin = 0;                   // COMBINE_SPIN, or 0 on one CPU where the lock holder cannot run while we poll
+static unsigned int combine_threads = 0;       // Threads that ever combined, to spread their home slots
+static __thread int combine_home = -1;         // This thread's first choice of slot
+
+static void rewrite_file();
+
+static void changed(int idx)
+{
+	if (cfg.changed)
+		cfg.changed(idx);
+}
+
+static void free_tree(STOCK_ITEM* ptr)
+{
+	if (ptr)
+	{
+		free_tree(ptr->left);    // Recursively free the left subtree
+		free_tree(ptr->right);   // Recursively free the right subtree
+		if (ptr->book)
+			book_free(ptr->book);
+		if (ptr->fc)
+			free(ptr->fc);
+		free(ptr);               // Free the memory allocated for the current node
+	}
+}
+
+static void stock_add_to_list(int stock_id, int left_stock, int stock_price)
+{
+	STOCK_ITEM* item = (STOCK_ITEM*)malloc(sizeof(STOCK_ITEM));   // Allocate memory for a new stock item
+	item->stock_id = stock_id;                                    // Set the stock ID
+	item->left_stock = left_stock;                                // Set the number of stocks left
+	item->stock_price = stock_price;                              // Set the stock price
+	item->book = NULL;
+	total_stock_num++;                                            // Increment the total stock count
+
+	if (stock_head == NULL)  // If the list is empty, set both head and tail to the new item
+	{
+		stock_head = item;
+		stock_tail = item;
+	}
+	else  // Otherwise, append the new item to the tail of the list
+	{
+		stock_tail->next = item;
+		stock_tail = item;
+	}
+}
+
+static int less(void* a, void* b)
+{
+	return (*(STOCK_ITEM*)a).stock_id - (*(STOCK_ITEM*)b).stock_id;  // Compare stock IDs and return the result
+}
+
+static STOCK_ITEM* stock_arr_to_bst(STOCK_ITEM* stock_arr, int start, int end)
+{
+	if (start > end)  // Base case: If the start index exceeds the end index, return NULL
+		return NULL;
+
+	int mid = (start + end) / 2;  // Calculate the middle index
+
+	STOCK_ITEM* item = (STOCK_ITEM*)malloc(sizeof(STOCK_ITEM));  // Allocate memory for a new stock item
+	item->stock_id = stock_arr[mid].stock_id;                     // Set the stock ID
+	item->left_stock = stock_arr[mid].left_stock;                 // Set the number of stocks left
+	item->stock_price = stock_arr[mid].stock_price;               // Set the stock price
+	item->next = NULL;
+	item->stock_readcnt = 0;
+	item->stock_idx = mid;
+	item->stock_seq = 0;
+	item->book = NULL;
+	item->wait_ns = 0;
+	item->hot = 0;
+	item->fc = NULL;
+	item->net = 0;
+	item->net_listed = 0;
+	stock_by_idx[mid] = item;
+	Sem_init(&item->mutex, 0, 1);    // Initialize the mutex semaphore with value 1
+	Sem_init(&item->writer, 0, 1);   // Initialize the writer semaphore with value 1
+
+	// Recursively build the binary search tree
+	item->left = stock_arr_to_bst(stock_arr, start, mid - 1);   // Build the left subtree
+	item->right = stock_arr_to_bst(stock_arr, mid + 1, end);    // Build the right subtree
+
+	return item;   // Return the root of the constructed binary search tree
+}
+
+static void stock_list_to_bst()
+{
+	STOCK_ITEM* stock_arr = (STOCK_ITEM*)malloc(sizeof(STOCK_ITEM) * total_stock_num);   // Allocate memory for an array of STOCK_ITEM objects
+	STOCK_ITEM* ptr = stock_head;
+	int i;
+
+	for (i = 0; i < total_stock_num; i++)
+	{
+		STOCK_ITEM* prev_ptr = ptr;
+		stock_arr[i].stock_id = ptr->stock_id;               // Copy the stock ID to the array
+		stock_arr[i].left_stock = ptr->left_stock;           // Copy the number of stocks left to the array
+		stock_arr[i].stock_price = ptr->stock_price;         // Copy the stock price to the array
+		ptr = ptr->next;
+		free(prev_ptr);                                      // Free the memory of the current list item as it has been moved to the array
+	}
+
+	stock_head = NULL;
+	stock_tail = NULL;
+
+	// Sort the array in ascending order based on stock IDs
+	qsort(stock_arr, total_stock_num, sizeof(STOCK_ITEM), less);
+
+	// Construct the binary search tree (BST) based on the sorted array
+	stock_by_idx = (STOCK_ITEM**)malloc(sizeof(STOCK_ITEM*) * total_stock_num);
+	dirty_map = (unsigned long*)calloc((total_stock_num + 63) / 64, sizeof(unsigned long));
+	root = stock_arr_to_bst(stock_arr, 0, total_stock_num - 1);
+
+	free(stock_arr);   // Free the memory allocated for the array as the BST has been constructed
+}
+
+
+static void inorder(char* stocks, int* len, STOCK_ITEM* ptr)
+{
+	if (ptr)
+	{
+		inorder(stocks, len, ptr->left);   // Traverse the left subtree
+
+		P(&(ptr->mutex));             // Acquire the mutex semaphore to protect access to stock_readcnt
+		ptr->stock_readcnt++;
+
+		if (ptr->stock_readcnt == 1)   // If this is the first reader
+			P(&(ptr->writer));         // Acquire the writer semaphore to block writers
+
+		V(&(ptr->mutex));             // Release the mutex semaphore
+
+		// Critical Section: Reading
+		*len += sprintf(stocks + *len, "%d %d %d	", ptr->stock_id, ptr->left_stock, ptr->stock_price);
+		// End of Critical Section: Reading
+
+		P(&(ptr->mutex));             // Acquire the mutex semaphore to protect access to stock_readcnt
+		ptr->stock_readcnt--;
+
+		if (ptr->stock_readcnt == 0)   // If there are no more readers
+			V(&(ptr->writer));         // Release the writer semaphore to unblock writers
+
+		V(&(ptr->mutex));             // Release the mutex semaphore
+
+		inorder(stocks, len, ptr->right);  // Traverse the right subtree
+	}
+}
+
+// Record that a node changed: its record on disk is stale, and it takes the
+// next change number, logged for "show since". Called with ptr->writer held.
+static void mark_dirty(STOCK_ITEM* ptr)
+{
+	long long seq = __atomic_add_fetch(&change_seq, 1, __ATOMIC_SEQ_CST);
+	change_t* c = &change_log[seq % CHANGE_LOG];
+
+	__atomic_fetch_or(&dirty_map[ptr->stock_idx / 64], 1UL << (ptr->stock_idx % 64), __ATOMIC_RELEASE);
+	__atomic_store_n(&c->seq, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->stock_idx, ptr->stock_idx, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&ptr->stock_seq, seq, __ATOMIC_RELAXED);
+}
+
+// Stock changed by change number seq, or -1 if the log has moved past it
+static int change_lookup(long long seq)
+{
+	change_t* c = &change_log[seq % CHANGE_LOG];
+	long long v;
+	int idx;
+
+	while (1)
+	{
+		v = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		if (v > seq)
+			return -1;
+		if (v == seq)
+		{
+			idx = __atomic_load_n(&c->stock_idx, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&c->seq, __ATOMIC_RELAXED) == seq)
+				return idx;
+			return -1;   // Overwritten while reading
+		}
+		sched_yield();   // The writer that took seq is still filling in the slot
+	}
+}
+
+static int int_less(const void* a, const void* b)
+{
+	return *(int*)a - *(int*)b;
+}
+
+// Bytes a show or since reply can take, newline included
+int engine_show_max()
+{
+	return 40 + total_stock_num * SHOW_LEN + 2;
+}
+
+// Render the reply of show into buf: every stock in stock_id order, each read
+// under its reader lock, and a newline. Returns its length.
+int engine_show(char* buf)
+{
+	int len = 0;
+
+	inorder(buf, &len, root);   // Perform inorder traversal of the BST and store the stock information in the buffer
+	buf[len++] = '\n';
+	return len;
+}
+
+// Render the reply of "show since <seq>" into buf: "[since] <now>" and, in
+// show's format, every stock changed after seq. Returns its length. Walks the
+// change log, so the cost follows the number of changes; a cursor the log no
+// longer covers, or one from before a restart, falls back to scanning
+// stock_seq of the whole catalog. Values may already include changes after
+// now: they are sent again next time, which is harmless.
+int engine_since(long long since, char* buf)
+{
+	long long now = __atomic_load_n(&change_seq, __ATOMIC_SEQ_CST), seq;
+	int* idxs = NULL;
+	int i, n = 0, len, full = since < 0 || since > now || now - since > CHANGE_LOG;
+
+	if (!full && now > since)
+	{
+		idxs = Malloc(sizeof(int) * (now - since));
+		for (seq = since + 1; seq <= now && !full; seq++)
+			if ((idxs[n++] = change_lookup(seq)) < 0)
+				full = 1;
+		qsort(idxs, n, sizeof(int), int_less);
+	}
+	if (full)
+	{
+		idxs = Realloc(idxs, sizeof(int) * (total_stock_num + 1));
+		for (i = n = 0; i < total_stock_num; i++)
+			if (since < 0 || since > now || __atomic_load_n(&stock_by_idx[i]->stock_seq, __ATOMIC_RELAXED) > since)
+				idxs[n++] = i;
+	}
+
+	len = sprintf(buf, "[since] %lld\t", now);
+	for (i = 0; i < n; i++)
+	{
+		STOCK_ITEM* ptr;
+
+		if (i > 0 && idxs[i] == idxs[i - 1])   // Changed more than once
+			continue;
+		ptr = stock_by_idx[idxs[i]];
+		len += sprintf(buf + len, "%d %d %d\t", ptr->stock_id,
+			__atomic_load_n(&ptr->left_stock, __ATOMIC_RELAXED), ptr->stock_price);
+	}
+	buf[len++] = '\n';
+	if (idxs)
+		Free(idxs);
+	return len;
+}
+
+static STOCK_ITEM* find_stock(int stock_id)
+{
+	STOCK_ITEM* ptr = root;
+
+	while (ptr && ptr->stock_id != stock_id)
+		ptr = stock_id < ptr->stock_id ? ptr->left : ptr->right;
+	return ptr;
+}
+
+int engine_count()
+{
+	return total_stock_num;
+}
+
+// stock_idx of stock_id, or -1 if it does not exist
+int engine_find(int stock_id)
+{
+	STOCK_ITEM* ptr = find_stock(stock_id);
+
+	return ptr ? ptr->stock_idx : -1;
+}
+
+// Latest values of the instrument at idx. left_stock is read without the
+// reader lock: this is for callers that only need the latest value and must
+// not queue behind a writer that is syncing the journal.
+void engine_stock(int idx, engine_stock_t* out)
+{
+	STOCK_ITEM* ptr = stock_by_idx[idx];
+
+	out->stock_id = ptr->stock_id;
+	out->left_stock = __atomic_load_n(&ptr->left_stock, __ATOMIC_RELAXED);
+	out->stock_price = ptr->stock_price;
+}
+
+// Charge a buy or sell of the instrument to the account, holding the
+// instrument's writer lock or running on its sequencer. Returns RESULT_OK
+// straight away for ACCOUNT_NONE.
+static int account_charge(int account_id, STOCK_ITEM* ptr, int side, int stock_num)
+{
+	account_leg_t leg;
+	int failed;
+
+	if (account_id == ACCOUNT_NONE)
+		return RESULT_OK;
+	leg.stock_idx = ptr->stock_idx;
+	leg.qty = side == ORDER_BUY ? stock_num : -stock_num;
+	leg.cash = (long long)stock_num * ptr->stock_price * (side == ORDER_BUY ? -1 : 1);
+	return account_apply(account_id, &leg, 1, 1, &failed);
+}
+
+// Sequencer engine: apply one buy or sell on the shard's sequencer thread. It is
+// the only thread changing the instruments of its shard, so no lock is taken.
+static void order_apply(seq_req_t* r)
+{
+	STOCK_ITEM* ptr = (STOCK_ITEM*)r->item;
+
+	r->ticket = 0;
+	if (r->op == ORDER_BUY && ptr->left_stock + ptr->net < r->stock_num)
+	{
+		r->result = RESULT_NOT_ENOUGH;
+		return;
+	}
+	if ((r->result = account_charge(r->account_id, ptr, r->op, r->stock_num)) != RESULT_OK)
+		return;
+	if (net_head)   // Only counted: order_flush() writes the window's orders of the stock together
+	{
+		if (!ptr->net_listed)
+		{
+			int shard = ptr->stock_idx % cfg.shards;
+
+			ptr->net_listed = 1;
+			ptr->net_next = net_head[shard];
+			net_head[shard] = ptr;
+		}
+		ptr->net += r->op == ORDER_BUY ? -r->stock_num : r->stock_num;
+		return;
+	}
+	ptr->left_stock += r->op == ORDER_BUY ? -r->stock_num : r->stock_num;
+	mark_dirty(ptr);
+	if (journal_on)
+		r->ticket = journal_append(r->op == ORDER_BUY ? JOURNAL_BUY : JOURNAL_SELL, ptr->stock_id, r->stock_num, ptr->left_stock);
+	changed(ptr->stock_idx);
+	r->result = RESULT_OK;
+}
+
+// Sequencer engine, netting: the window of shard is over. Every order in it
+// was accepted or rejected by order_apply() against left_stock plus the net
+// of the orders before it, just as if each had been applied on its own; now
+// the net change of each stock is written as one update: one change number,
+// one journal record and one watch update, none if buys and sells cancelled
+// out. The accepted orders then wait for that record.
+static void order_flush(int shard, seq_req_t** reqs, int n)
+{
+	STOCK_ITEM* ptr;
+	int i;
+
+	for (ptr = net_head[shard]; ptr; ptr = ptr->net_next)
+	{
+		ptr->net_ticket = 0;
+		if (ptr->net != 0)
+		{
+			ptr->left_stock += ptr->net;
+			mark_dirty(ptr);
+			if (journal_on)
+				ptr->net_ticket = journal_append(ptr->net < 0 ? JOURNAL_BUY : JOURNAL_SELL, ptr->stock_id, abs(ptr->net), ptr->left_stock);
+			changed(ptr->stock_idx);
+		}
+		ptr->net = 0;
+		ptr->net_listed = 0;
+	}
+	net_head[shard] = NULL;
+	for (i = 0; i < n; i++)
+		if (reqs[i]->result == RESULT_OK)
+			reqs[i]->ticket = ((STOCK_ITEM*)reqs[i]->item)->net_ticket;
+}
+
+// Sequencer engine: publish a buy or sell to the instrument's shard and wait for its result
+static int order_submit(int account_id, int side, int stock_id, int stock_num)
+{
+	STOCK_ITEM* ptr = find_stock(stock_id);
+	seq_req_t r;
+
+	if (ptr == NULL)
+		return RESULT_NO_STOCK;
+	r.op = side;
+	r.item = ptr;
+	r.stock_num = stock_num;
+	r.account_id = account_id;
+	seq_publish(ptr->stock_idx % cfg.shards, &r);
+	seq_wait(&r);
+	journal_wait(r.ticket);
+	return r.result;
+}
+
+static long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+// Locked engine: acquire the writer semaphore of ptr for a buy or sell and
+// keep a moving average of how long that took. When the average passes
+// combine_ns the stock turns hot, and its buys and sells go to combine().
+static void order_lock(STOCK_ITEM* ptr)
+{
+	long start, waited = 0;
+
+	if (sem_trywait(&ptr->writer) < 0)   // Only a contended acquire is timed
+	{
+		start = now_ns();
+		P(&ptr->writer);
+		waited = now_ns() - start;
+	}
+	if (cfg.combine_ns <= 0)
+		return;
+	ptr->wait_ns += (int)((waited - ptr->wait_ns) / 8);
+	if (ptr->wait_ns > cfg.combine_ns && !ptr->hot)
+	{
+		if (ptr->fc == NULL)
+		{
+			if (posix_memalign((void**)&ptr->fc, 64, sizeof(combine_t)) != 0)
+				unix_error("posix_memalign error");
+			memset(ptr->fc, 0, sizeof(combine_t));
+		}
+		ptr->fc->holds = ptr->fc->applied = 0;
+		__atomic_store_n(&ptr->hot, 1, __ATOMIC_RELEASE);
+	}
+}
+
+// The critical section of a buy or sell, with the writer semaphore of ptr held
+static int order_locked(STOCK_ITEM* ptr, int account_id, int side, int stock_num, long long* ticket)
+{
+	int result;
+
+	*ticket = 0;
+	if (side == ORDER_BUY)
+		result = ptr->left_stock >= stock_num ? account_charge(account_id, ptr, ORDER_BUY, stock_num) : RESULT_NOT_ENOUGH;
+	else
+		result = account_charge(account_id, ptr, ORDER_SELL, stock_num);
+	if (result == RESULT_OK)   // Sufficient stocks, and cash or position if it is for an account
+	{
+		ptr->left_stock += side == ORDER_BUY ? -stock_num : stock_num;
+		mark_dirty(ptr);
+		if (journal_on)
+			*ticket = journal_append(side == ORDER_BUY ? JOURNAL_BUY : JOURNAL_SELL, ptr->stock_id, stock_num, ptr->left_stock);
+	}
+	return result;
+}
+
+// With the writer semaphore of a hot stock held, apply every request published
+// to its combining array, then decide whether the stock is still hot: once
+// lock holds find fewer than COMBINE_OFF requests on average, the plain lock
+// is cheaper again.
+static void combine_pass(STOCK_ITEM* ptr)
+{
+	combine_t* fc = ptr->fc;
+	combine_slot_t* s;
+	int i, pass, n, applied = 0;
+
+	for (pass = 0; pass < COMBINE_PASSES; pass++)
+	{
+		for (i = 0, n = 0; i < COMBINE_SLOTS; i++)
+		{
+			s = &fc->slots[i];
+			if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != SLOT_PENDING)
+				continue;
+			s->result = order_locked(ptr, s->account_id, s->side, s->stock_num, &s->ticket);
+			__atomic_store_n(&s->state, SLOT_DONE, __ATOMIC_RELEASE);
+			n++;
+		}
+		applied += n;
+		if (n == 0)
+			break;
+	}
+	fc->applied += applied;
+	if (++fc->holds == COMBINE_WINDOW)
+	{
+		if (fc->applied < COMBINE_WINDOW * COMBINE_OFF)
+		{
+			ptr->wait_ns = 0;
+			__atomic_store_n(&ptr->hot, 0, __ATOMIC_RELAXED);
+		}
+		fc->holds = fc->applied = 0;
+	}
+}
+
+// Locked engine, hot stock: publish the order to a slot of the combining
+// array instead of queueing on the writer semaphore. Whichever thread gets the
+// semaphore applies every published order in one hold, so a crowd of writers
+// costs one handoff instead of one each. Waiters poll their slot and try the
+// semaphore while they poll; after combine_spin polls they sleep on it, and
+// then apply whatever is still published themselves. Returns RESULT_*.
+static int combine(STOCK_ITEM* ptr, int account_id, int side, int stock_num, long long* ticket)
+{
+	combine_t* fc = ptr->fc;
+	combine_slot_t* s = NULL;
+	int i, free_slot, result;
+
+	if (combine_home < 0)
+		combine_home = __atomic_fetch_add(&combine_threads, 1, __ATOMIC_RELAXED) % COMBINE_SLOTS;
+	for (i = 0; i < COMBINE_SLOTS && s == NULL; i++)
+	{
+		free_slot = SLOT_FREE;
+		s = &fc->slots[(combine_home + i) % COMBINE_SLOTS];
+		if (!__atomic_compare_exchange_n(&s->state, &free_slot, SLOT_CLAIMED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			s = NULL;
+	}
+	if (s == NULL)   // More writers than slots: queue like a cold stock
+	{
+		order_lock(ptr);
+		result = order_locked(ptr, account_id, side, stock_num, ticket);
+		V(&ptr->writer);
+		return result;
+	}
+	s->side = side;
+	s->stock_num = stock_num;
+	s->account_id = account_id;
+	__atomic_store_n(&s->state, SLOT_PENDING, __ATOMIC_RELEASE);
+
+	for (i = 0; __atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != SLOT_DONE; i++)
+	{
+		if (i < combine_spin && sem_trywait(&ptr->writer) < 0)
+		{
+			cpu_relax();
+			continue;
+		}
+		if (i >= combine_spin)
+			P(&ptr->writer);
+		combine_pass(ptr);   // Applies ours too if it is still published
+		V(&ptr->writer);
+	}
+	result = s->result;
+	*ticket = s->ticket;
+	__atomic_store_n(&s->state, SLOT_FREE, __ATOMIC_RELEASE);
+	return result;
+}
+
+// Apply a buy order for the account and return RESULT_*. The caller sends the
+// reply; by then the order is as durable as the selected durability level
+// promises.
+int engine_buy(int account_id, int stock_id, int stock_num)
+{
+	STOCK_ITEM* ptr = root;
+	long long ticket = 0;
+	int result;
+
+	if (stock_num <= 0)   // A negative buy would be the opposite order without its checks
+		return RESULT_INVALID;
+	if (cfg.mode == ENGINE_SEQUENCER)
+		return order_submit(account_id, ORDER_BUY, stock_id, stock_num);
+	while (ptr)   // Search for the stock_id in the binary search tree
+	{
+		if (ptr->stock_id == stock_id)
+		{
+			break;
+		}
+		else if (stock_id < ptr->stock_id)
+		{
+			ptr = ptr->left;
+		}
+		else
+		{
+			ptr = ptr->right;
+		}
+	}
+	if (ptr == NULL)   // Stock_id does not exist
+		return RESULT_NO_STOCK;
+
+	if (__atomic_load_n(&ptr->hot, __ATOMIC_ACQUIRE))   // Contended: the lock holder applies it with the rest
+		result = combine(ptr, account_id, ORDER_BUY, stock_num, &ticket);
+	else
+	{
+		order_lock(ptr);   // Acquire the writer semaphore to block other writers
+		result = order_locked(ptr, account_id, ORDER_BUY, stock_num, &ticket);
+		V(&(ptr->writer));   // Release the writer semaphore to allow other writers
+	}
+
+	if (result != RESULT_OK)   // Insufficient stocks or cash
+		return result;
+	changed(ptr->stock_idx);
+	journal_wait(ticket);   // A sync or group commit must not hold up other orders on this stock
+	return RESULT_OK;
+}
+
+// Apply a sell order for the account and return RESULT_*, see engine_buy()
+int engine_sell(int account_id, int stock_id, int stock_num)
+{
+	STOCK_ITEM* ptr = root;
+	long long ticket = 0;
+	int result;
+
+	if (stock_num <= 0)   // A negative sell would be the opposite order without its checks
+		return RESULT_INVALID;
+	if (cfg.mode == ENGINE_SEQUENCER)
+		return order_submit(account_id, ORDER_SELL, stock_id, stock_num);
+	while (ptr)   // Search for the stock_id in the binary search tree
+	{
+		if (ptr->stock_id == stock_id)
+		{
+			break;
+		}
+		else if (stock_id < ptr->stock_id)
+		{
+			ptr = ptr->left;
+		}
+		else
+		{
+			ptr = ptr->right;
+		}
+	}
+	if (ptr == NULL)   // Stock_id does not exist
+		return RESULT_NO_STOCK;
+
+	if (__atomic_load_n(&ptr->hot, __ATOMIC_ACQUIRE))   // Contended: the lock holder applies it with the rest
+		result = combine(ptr, account_id, ORDER_SELL, stock_num, &ticket);
+	else
+	{
+		order_lock(ptr);   // Acquire the writer semaphore to block other writers
+		result = order_locked(ptr, account_id, ORDER_SELL, stock_num, &ticket);
+		V(&(ptr->writer));   // Release the writer semaphore to allow other writers
+	}
+
+	if (result != RESULT_OK)   // Not enough of the stock in the account
+		return result;
+	changed(ptr->stock_idx);
+	journal_wait(ticket);   // A sync or group commit must not hold up other orders on this stock
+	return RESULT_OK;
+}
+
+// Orders of the same instrument stay in submission order
+static int batch_less(const void* a, const void* b)
+{
+	engine_order_t* x = *(engine_order_t**)a;
+	engine_order_t* y = *(engine_order_t**)b;
+
+	if (x->stock_id != y->stock_id)
+		return x->stock_id < y->stock_id ? -1 : 1;
+	return x < y ? -1 : x > y;
+}
+
+// Sequencer engine: publish every order of a batch before waiting for any, so
+// the shards work on them in parallel. Orders of one instrument go to the same
+// ring in submission order, which keeps line-by-line outcomes.
+static void order_batch_submit(engine_order_t* orders, int n)
+{
+	seq_req_t reqs[BATCH_MAX];
+	long long ticket = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		STOCK_ITEM* ptr = find_stock(orders[i].stock_id);
+
+		reqs[i].op = -1;
+		if (ptr == NULL)
+			orders[i].result = RESULT_NO_STOCK;
+		else if ((orders[i].side != ORDER_BUY && orders[i].side != ORDER_SELL) || orders[i].stock_num <= 0)
+			orders[i].result = RESULT_INVALID;
+		else
+		{
+			reqs[i].op = orders[i].side;
+			reqs[i].item = ptr;
+			reqs[i].stock_num = orders[i].stock_num;
+			reqs[i].account_id = ACCOUNT_NONE;
+			seq_publish(ptr->stock_idx % cfg.shards, &reqs[i]);
+		}
+	}
+	for (i = 0; i < n; i++)
+		if (reqs[i].op >= 0)
+		{
+			seq_wait(&reqs[i]);
+			orders[i].result = reqs[i].result;
+			if (reqs[i].ticket > ticket)
+				ticket = reqs[i].ticket;
+		}
+	journal_wait(ticket);
+}
+
+// Apply n orders in one pass: sort them by stock_id, then look up each
+// instrument and take its writer lock once for all of its orders. The outcome
+// of every order is the same as if the batch had run line by line. Orders for
+// an account do run line by line: its cash ties instruments together, so
+// regrouping them could change which orders it can pay for.
+void engine_batch(int account_id, engine_order_t* orders, int n)
+{
+	engine_order_t* sorted[BATCH_MAX];
+	long long ticket = 0;
+	int i, j, applied;
+
+	if (account_id != ACCOUNT_NONE)
+	{
+		for (i = 0; i < n; i++)
+		{
+			if (orders[i].side == ORDER_BUY)
+				orders[i].result = engine_buy(account_id, orders[i].stock_id, orders[i].stock_num);
+			else if (orders[i].side == ORDER_SELL)
+				orders[i].result = engine_sell(account_id, orders[i].stock_id, orders[i].stock_num);
+			else
+				orders[i].result = find_stock(orders[i].stock_id) ? RESULT_INVALID : RESULT_NO_STOCK;
+		}
+		return;
+	}
+	if (cfg.mode == ENGINE_SEQUENCER)
+	{
+		order_batch_submit(orders, n);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		sorted[i] = &orders[i];
+	qsort(sorted, n, sizeof(engine_order_t*), batch_less);
+
+	for (i = 0; i < n; i = j)
+	{
+		STOCK_ITEM* ptr = find_stock(sorted[i]->stock_id);
+
+		for (j = i; j < n && sorted[j]->stock_id == sorted[i]->stock_id; j++)
+			sorted[j]->result = ptr ? RESULT_OK : RESULT_NO_STOCK;
+		if (ptr == NULL)
+			continue;
+
+		P(&(ptr->writer));   // Once for every order on this instrument
+
+		// Critical Section: Writing
+		applied = 0;
+		for (j = i; j < n && sorted[j]->stock_id == sorted[i]->stock_id; j++)
+		{
+			engine_order_t* o = sorted[j];
+
+			if (o->stock_num <= 0)
+			{
+				o->result = RESULT_INVALID;
+				continue;
+			}
+			if (o->side == ORDER_BUY && ptr->left_stock >= o->stock_num)
+				ptr->left_stock -= o->stock_num;
+			else if (o->side == ORDER_SELL)
+				ptr->left_stock += o->stock_num;
+			else
+			{
+				o->result = o->side == ORDER_BUY ? RESULT_NOT_ENOUGH : RESULT_INVALID;
+				continue;
+			}
+			mark_dirty(ptr);
+			applied++;
+			if (journal_on)
+				ticket = journal_append(o->side == ORDER_BUY ? JOURNAL_BUY : JOURNAL_SELL,
+					o->stock_id, o->stock_num, ptr->left_stock);
+		}
+		// End of Critical Section: Writing
+
+		V(&(ptr->writer));
+		if (applied)
+			changed(ptr->stock_idx);
+	}
+	journal_wait(ticket);   // Tickets only grow, so the last one covers the whole batch
+}
+
+// Sequencer engine: park (or with park 0, release) the shards of the n
+// instruments, lowest shard first. Parked shards apply nothing, so the caller
+// owns their instruments in between. multi_mutex keeps two multi-leg orders
+// from each parking one shard the other waits for.
+static void park_shards(STOCK_ITEM** items, int n, int park)
+{
+	int shard[MULTI_MAX], nshard = 0, i, k;
+
+	for (i = 0; i < n; i++)
+	{
+		int s = items[i]->stock_idx % cfg.shards;
+
+		for (k = 0; k < nshard && shard[k] != s; k++)
+			;
+		if (k == nshard)
+			shard[nshard++] = s;
+	}
+	qsort(shard, nshard, sizeof(int), int_less);
+
+	if (park)
+	{
+		P(&multi_mutex);
+		for (k = 0; k < nshard; k++)
+			seq_park(shard[k]);
+	}
+	else
+	{
+		for (k = 0; k < nshard; k++)
+			seq_unpark(shard[k]);
+		V(&multi_mutex);
+	}
+}
+
+// Apply the n legs of a multi-leg order all or none. The instruments involved
+// are write-locked in stock_id order, so two baskets that overlap cannot
+// deadlock, and every leg is checked against the locked state before any is
+// applied. For an account, each leg is also checked against its cash and
+// positions as the legs before it would leave them. Returns RESULT_OK, or the
+// RESULT_* of the first leg, in submission order, that failed; *failed is set
+// to that leg's index.
+int engine_multi(int account_id, engine_order_t* legs, int n, int* failed)
+{
+	engine_order_t* sorted[MULTI_MAX];
+	STOCK_ITEM* locked[MULTI_MAX];
+	int left[MULTI_MAX];            // left_stock of locked[k] as the legs so far would leave it
+	journal_rec_t recs[MULTI_MAX];
+	account_leg_t charges[MULTI_MAX];
+	long long ticket = 0;
+	int i, k, nlocked = 0, charged, result;
+
+	*failed = -1;
+	for (i = 0; i < n; i++)
+	{
+		legs[i].result = RESULT_OK;
+		if ((legs[i].side != ORDER_BUY && legs[i].side != ORDER_SELL) || legs[i].stock_num <= 0)
+			legs[i].result = RESULT_INVALID;
+		else if (find_stock(legs[i].stock_id) == NULL)
+			legs[i].result = RESULT_NO_STOCK;
+		if (legs[i].result != RESULT_OK)
+		{
+			*failed = i;
+			return legs[i].result;
+		}
+		sorted[i] = &legs[i];
+	}
+	qsort(sorted, n, sizeof(engine_order_t*), batch_less);
+
+	for (i = 0; i < n; i++)   // Lock each instrument once, lowest stock_id first
+	{
+		if (nlocked > 0 && locked[nlocked - 1]->stock_id == sorted[i]->stock_id)
+			continue;
+		locked[nlocked++] = find_stock(sorted[i]->stock_id);
+	}
+	if (cfg.mode == ENGINE_SEQUENCER)
+		park_shards(locked, nlocked, 1);
+	for (k = 0; k < nlocked; k++)
+	{
+		if (cfg.mode == ENGINE_LOCKED)
+			P(&(locked[k]->writer));
+		left[k] = locked[k]->left_stock;
+	}
+
+	// Critical Section: Writing
+	for (i = 0; i < n; i++)   // Check in submission order, on the scratch copies
+	{
+		for (k = 0; locked[k]->stock_id != legs[i].stock_id; k++)
+			;
+		if (legs[i].side == ORDER_BUY && left[k] < legs[i].stock_num)
+		{
+			legs[i].result = RESULT_NOT_ENOUGH;
+			*failed = i;
+			break;
+		}
+		left[k] += legs[i].side == ORDER_BUY ? -legs[i].stock_num : legs[i].stock_num;
+		charges[i].stock_idx = locked[k]->stock_idx;
+		charges[i].qty = legs[i].side == ORDER_BUY ? legs[i].stock_num : -legs[i].stock_num;
+		charges[i].cash = (long long)-charges[i].qty * locked[k]->stock_price;
+		recs[i].stock_id = legs[i].stock_id;
+		recs[i].op = legs[i].side == ORDER_BUY ? JOURNAL_BUY : JOURNAL_SELL;
+		recs[i].stock_num = legs[i].stock_num;
+		recs[i].left_stock = left[k];
+	}
+	if (account_id != ACCOUNT_NONE)   // The legs before a failed one must pass too, it may not be the first
+	{
+		charged = *failed < 0 ? n : *failed;
+		if ((result = account_apply(account_id, charges, charged, *failed < 0, &i)) != RESULT_OK)
+		{
+			legs[i].result = result;
+			*failed = i;
+		}
+	}
+	if (*failed < 0)
+	{
+		for (k = 0; k < nlocked; k++)
+		{
+			locked[k]->left_stock = left[k];
+			mark_dirty(locked[k]);
+		}
+		if (journal_on)
+			ticket = journal_append_legs(recs, n);
+	}
+	// End of Critical Section: Writing
+
+	if (cfg.mode == ENGINE_SEQUENCER)
+		park_shards(locked, nlocked, 0);
+	else
+		for (k = nlocked - 1; k >= 0; k--)
+			V(&(locked[k]->writer));
+
+	if (*failed >= 0)
+		return legs[*failed].result;
+	for (k = 0; k < nlocked; k++)
+		changed(locked[k]->stock_idx);
+	journal_wait(ticket);
+	return RESULT_OK;
+}
+
+// Match a bid or ask against the instrument's order book and rest what is
+// left in it. fill is called for every fill, under the writer lock. Returns
+// RESULT_INVALID if the price is out of the book's range or qty is not
+// positive. The book is in memory only: it is neither journaled nor
+// persisted, and does not touch left_stock.
+int engine_limit(int stock_id, int side, int price, int qty, long long* id, int* resting, book_fill_t* fill, void* arg)
+{
+	STOCK_ITEM* ptr = find_stock(stock_id);
+
+	if (ptr == NULL)
+		return RESULT_NO_STOCK;
+	if (qty <= 0)
+		return RESULT_INVALID;
+	P(&(ptr->writer));
+	if (ptr->book == NULL)
+		ptr->book = book_new(ptr->stock_price);
+	*resting = book_add(ptr->book, side, price, qty, id, fill, arg);
+	V(&(ptr->writer));
+	return *resting < 0 ? RESULT_INVALID : RESULT_OK;
+}
+
+// Take a resting order off the book; *qty is set to what it had left.
+// Returns RESULT_INVALID if there is no such order.
+int engine_cancel(int stock_id, long long order_id, int* qty)
+{
+	STOCK_ITEM* ptr = find_stock(stock_id);
+
+	if (ptr == NULL)
+		return RESULT_NO_STOCK;
+	*qty = -1;
+	P(&(ptr->writer));
+	if (ptr->book)
+		*qty = book_cancel(ptr->book, order_id);
+	V(&(ptr->writer));
+	return *qty < 0 ? RESULT_INVALID : RESULT_OK;
+}
+
+// The BOOK_DEPTH best levels of each side of the instrument's book
+int engine_book(int stock_id, engine_book_t* out)
+{
+	STOCK_ITEM* ptr = find_stock(stock_id);
+	int side;
+
+	if (ptr == NULL)
+		return RESULT_NO_STOCK;
+	out->last_price = 0;
+	out->n[SIDE_BID] = out->n[SIDE_ASK] = 0;
+	P(&(ptr->writer));   // The book has no reader protocol of its own
+	if (ptr->book)
+	{
+		for (side = SIDE_BID; side <= SIDE_ASK; side++)
+			out->n[side] = book_depth(ptr->book, side, out->prices[side], out->qtys[side], BOOK_DEPTH);
+		out->last_price = ptr->book->last_price;
+	}
+	V(&(ptr->writer));
+	return RESULT_OK;
+}
+
+// Open the account if it does not exist yet. Returns RESULT_INVALID unless
+// account_id is positive, or if orders are journaled: a crash would recover
+// the instruments but not the cash and positions that paid for them.
+int engine_account(int account_id)
+{
+	if (journal_on)
+		return RESULT_INVALID;
+	return account_open(account_id);
+}
+
+// Add amount to the account's cash, or take it out if it is negative, and set
+// *cash to the balance after it. Returns RESULT_NO_CASH if the balance would go
+// below zero, RESULT_INVALID if there is no such account.
+int engine_deposit(int account_id, long long amount, long long* cash)
+{
+	account_leg_t leg = { -1, 0, amount };
+	int failed, result = account_apply(account_id, &leg, 1, 1, &failed);
+
+	if (result != RESULT_INVALID)
+		account_get(account_id, cash, NULL, NULL);
+	return result;
+}
+
+typedef struct {
+	engine_position_t* out;
+	int n;
+} balance_t;
+
+static void add_position(void* arg, int stock_idx, int qty)
+{
+	balance_t* b = (balance_t*)arg;
+
+	b->out[b->n].stock_id = stock_by_idx[stock_idx]->stock_id;
+	b->out[b->n++].qty = qty;
+}
+
+static int position_less(const void* a, const void* b)
+{
+	return ((engine_position_t*)a)->stock_id - ((engine_position_t*)b)->stock_id;
+}
+
+// The account's cash and its positions in stock_id order. out needs room for
+// engine_count() positions; *n is set to how many it holds. Returns
+// RESULT_INVALID if there is no such account.
+int engine_balance(int account_id, long long* cash, engine_position_t* out, int* n)
+{
+	balance_t b = { out, 0 };
+	int result = account_get(account_id, cash, add_position, &b);
+
+	qsort(out, b.n, sizeof(engine_position_t), position_less);
+	*n = b.n;
+	return result;
+}
+
+// Copy every instrument in stock_id order into out, each under its reader lock
+void engine_collect(engine_stock_t* out)
+{
+	int i;
+
+	for (i = 0; i < total_stock_num; i++)
+	{
+		STOCK_ITEM* ptr = stock_by_idx[i];
+
+		P(&(ptr->mutex));
+		ptr->stock_readcnt++;
+		if (ptr->stock_readcnt == 1)   // First reader
+			P(&(ptr->writer));
+		V(&(ptr->mutex));
+		// Critical Section: Reading
+
+		out[i].stock_id = ptr->stock_id;
+		out[i].left_stock = ptr->left_stock;
+		out[i].stock_price = ptr->stock_price;
+
+		// End of Critical Section: Reading
+		P(&(ptr->mutex));
+		ptr->stock_readcnt--;
+		if (ptr->stock_readcnt == 0)   // Last reader
+			V(&(ptr->writer));
+		V(&(ptr->mutex));
+	}
+}
+
+static void load_stock_to_memory()
+{
+	FILE* fp = fopen("stock.txt", "r");   // Open the file "stock.txt" in read mode
+	int res;
+	int stock_id;
+	int left_stock;
+	int stock_price;
+	while (1)
+	{
+		res = fscanf(fp, "%d %d %d", &stock_id, &left_stock, &stock_price);
+		if (res == EOF)
+			break;
+		stock_add_to_list(stock_id, left_stock, stock_price);   // Add the stock information to the temporary list
+	}
+	stock_list_to_bst();   // Convert the temporary list to a binary search tree (BST)
+	fclose(fp);   // Close the file
+}
+
+
+// Read the accounts file: a line per account, "<account_id> <cash>" followed by
+// " <stock_id>:<qty>" for each position. Positions in stocks that are gone are
+// dropped.
+static void load_accounts()
+{
+	FILE* fp = fopen(cfg.accounts, "r");
+	char* line = NULL;
+	size_t cap = 0;
+	account_leg_t leg;
+	long long cash;
+	int account_id, stock_id, qty, off, n, failed;
+
+	if (fp == NULL)   // No accounts yet
+		return;
+	while (getline(&line, &cap, fp) > 0)
+	{
+		if (sscanf(line, "%d %lld%n", &account_id, &cash, &off) != 2 || account_open(account_id) != RESULT_OK)
+			continue;
+		leg.stock_idx = -1;
+		leg.qty = 0;
+		leg.cash = cash;
+		account_apply(account_id, &leg, 1, 1, &failed);
+		for (; sscanf(line + off, " %d:%d%n", &stock_id, &qty, &n) == 2; off += n)
+		{
+			STOCK_ITEM* ptr = find_stock(stock_id);
+
+			if (ptr == NULL || qty <= 0)
+				continue;
+			leg.stock_idx = ptr->stock_idx;
+			leg.qty = qty;
+			leg.cash = 0;
+			account_apply(account_id, &leg, 1, 1, &failed);
+		}
+	}
+	free(line);
+	fclose(fp);
+}
+
+static void print_account(void* arg, int account_id, long long cash)
+{
+	FILE* fp = *(FILE**)arg;
+
+	fprintf(fp, ftell(fp) > 0 ? "\n%d %lld" : "%d %lld", account_id, cash);
+}
+
+static void print_position(void* arg, int stock_idx, int qty)
+{
+	fprintf(*(FILE**)arg, " %d:%d", stock_by_idx[stock_idx]->stock_id, qty);
+}
+
+// Rewrite the accounts file through a temporary file, like stock.txt. Only
+// called by engine_flush(), once orders have stopped, so the shard locks that
+// account_each() holds around the buffered writes hold up nobody.
+static void save_accounts()
+{
+	char tmp[MAXLINE];
+	FILE* fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cfg.accounts);
+	if ((fp = fopen(tmp, "w")) == NULL)
+		unix_error("accounts file open error");
+	account_each(print_account, print_position, &fp);
+	if (ftell(fp) > 0)
+		fputc('\n', fp);
+	if (fclose(fp) != 0 || rename(tmp, cfg.accounts) < 0)
+		unix_error("accounts file write error");
+}
+
+static void inorder_print(STOCK_ITEM* ptr, FILE* fp)
+{
+	int left_stock;
+
+	if (ptr)
+	{
+		inorder_print(ptr->left, fp);
+
+		P(&(ptr->mutex));
+		ptr->stock_readcnt++;
+		if (ptr->stock_readcnt == 1)   // First reader
+			P(&(ptr->writer));
+		V(&(ptr->mutex));
+		// Critical Section: Reading
+
+		left_stock = ptr->left_stock;   // fprintf may flush to disk, so it runs after the lock is dropped
+
+		// End of Critical Section: Reading
+
+		P(&(ptr->mutex));
+		ptr->stock_readcnt--;
+		if (ptr->stock_readcnt == 0)   // Last reader
+			V(&(ptr->writer));
+		V(&(ptr->mutex));
+
+		fprintf(fp, "%d %d %d\n", ptr->stock_id, left_stock, ptr->stock_price);   // Write the stock information to the file
+
+		inorder_print(ptr->right, fp);
+	}
+}
+
+static void rewrite_file()
+{
+	int seg = 0;
+
+	P(&file_mutex);   // Acquire the file_mutex semaphore to ensure exclusive access to the file
+	// FILE WRITE, Critical Section
+	if (journal_on)
+		seg = journal_rotate();   // Orders from here on go to a segment this snapshot does not cover
+	FILE* fp = fopen("stock.txt.tmp", "w");   // Write a new file so a crash never leaves a half-written stock.txt
+	inorder_print(root, fp);   // Perform an inorder traversal of the BST and write the stock information to the file
+	fflush(fp);
+	fsync(fileno(fp));
+	fclose(fp);   // Close the file
+	rename("stock.txt.tmp", "stock.txt");
+	if (journal_on)
+		journal_drop_before(seg);   // The snapshot is durable, older orders are no longer needed
+	// End of FILE WRITE, Critical Section
+	V(&file_mutex);   // Release the file_mutex semaphore
+}
+
+// Write one "id left price" line per node into buf, handing full buffers to write(2).
+// Runs in the snapshot child: no locks, no malloc and no stdio, since any of them
+// may have been held by another thread of the parent at the moment of fork().
+static void snapshot_print(STOCK_ITEM* ptr, int fd, char* buf, int* len)
+{
+	if (ptr)
+	{
+		snapshot_print(ptr->left, fd, buf, len);
+		if (*len > MAXBUF - 64)
+		{
+			rio_writen(fd, buf, *len);
+			*len = 0;
+		}
+		*len += snprintf(buf + *len, MAXBUF - *len, "%d %d %d\n", ptr->stock_id, ptr->left_stock, ptr->stock_price);
+		snapshot_print(ptr->right, fd, buf, len);
+	}
+}
+
+// Sum of Private_Clean and Private_Dirty of the calling process in kB.
+// Read in the child right before it exits, this is the memory the parent's writes
+// forced the kernel to duplicate while the snapshot was in progress.
+static long private_kb()
+{
+	char buf[2048];
+	char* p;
+	long kb = 0;
+	int n, fd = open("/proc/self/smaps_rollup", O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	for (p = buf; (p = strstr(p, "Private_")) != NULL; p++)
+		kb += strtol(strchr(p, ':') + 1, NULL, 10);
+	return kb;
+}
+
+// Body of the snapshot child: serialize the frozen tree to a temporary file,
+// atomically rename it over stock.txt and report the copy-on-write overhead.
+static void snapshot_child(int report_fd)
+{
+	char buf[MAXBUF];
+	int len = 0;
+	long kb;
+	int fd = open("stock.txt.tmp", O_WRONLY | O_CREAT | O_TRUNC, DEF_MODE);
+
+	if (fd < 0)
+		_exit(1);
+	snapshot_print(root, fd, buf, &len);
+	if (len > 0)
+		rio_writen(fd, buf, len);
+	if (fsync(fd) < 0 || close(fd) < 0 || rename("stock.txt.tmp", "stock.txt") < 0)
+		_exit(1);
+
+	kb = private_kb();
+	rio_writen(report_fd, &kb, sizeof(kb));
+	_exit(0);
+}
+
+// Take one snapshot: fork, let the child write, and report how long the parent
+// was paused inside fork() and how much memory copy-on-write cost in the meantime.
+// file_mutex is held until the child has been reaped, so a rewrite_file() from
+// engine_flush() never runs beside the child: both write stock.txt.tmp, and the
+// child's older state must not be renamed over the final one.
+static void snapshot_fork()
+{
+	struct timeval start, end;
+	int pipefd[2];
+	int status;
+	long cow_kb = -1;
+	int seg = 0;
+	pid_t pid;
+
+	if (pipe(pipefd) < 0)
+	{
+		rewrite_file();   // Fall back to the synchronous path
+		return;
+	}
+	P(&file_mutex);
+	if (journal_on)
+		seg = journal_rotate();
+
+	gettimeofday(&start, NULL);
+	pid = fork();
+	gettimeofday(&end, NULL);
+
+	if (pid < 0)
+	{
+		V(&file_mutex);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		rewrite_file();
+		return;
+	}
+	if (pid == 0)
+	{
+		close(pipefd[0]);
+		snapshot_child(pipefd[1]);
+	}
+
+	snapshot_pid = pid;
+	close(pipefd[1]);
+	if (rio_readn(pipefd[0], &cow_kb, sizeof(cow_kb)) != sizeof(cow_kb))
+		cow_kb = -1;
+	close(pipefd[0]);
+	Waitpid(pid, &status, 0);
+	snapshot_pid = 0;
+	if (journal_on && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		journal_drop_before(seg);
+	V(&file_mutex);
+
+	printf("[snapshot] child %d %s, parent paused %ld us in fork, copy-on-write overhead %ld kB\n",
+		(int)pid, (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? "done" : "failed",
+		(end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec), cow_kb);
+}
+
+static void* snapshot_thread(void* vargp)
+{
+	Pthread_detach(pthread_self());
+
+	while (1)
+	{
+		P(&snapshot_req);   // Wait for a snapshot request
+		while (sem_trywait(&snapshot_req) == 0)
+			;               // Requests that piled up during the last snapshot are all served by the next one
+		snapshot_fork();
+	}
+	return NULL;
+}
+
+// Format one fixed-width record under the node's reader lock
+static void format_record(STOCK_ITEM* ptr, char* buf)
+{
+	char temp[RECORD_LEN + 1];
+
+	P(&(ptr->mutex));
+	ptr->stock_readcnt++;
+	if (ptr->stock_readcnt == 1)   // First reader
+		P(&(ptr->writer));
+	V(&(ptr->mutex));
+	// Critical Section: Reading
+
+	snprintf(temp, sizeof(temp), "%11d %11d %11d\n", ptr->stock_id, ptr->left_stock, ptr->stock_price);
+
+	// End of Critical Section: Reading
+	P(&(ptr->mutex));
+	ptr->stock_readcnt--;
+	if (ptr->stock_readcnt == 0)   // Last reader
+		V(&(ptr->writer));
+	V(&(ptr->mutex));
+
+	memcpy(buf, temp, RECORD_LEN);
+}
+
+// Write the records of every dirty node in place. Runs of adjacent dirty records
+// are coalesced into a single pwrite, so the cost follows the number of
+// instruments traded since the last flush rather than the size of the catalog.
+static void flush_dirty()
+{
+	char buf[MAXBUF - MAXBUF % RECORD_LEN];
+	int run_start = -1;   // stock_idx of the first record in buf
+	int run_len = 0;      // Number of records in buf
+	int records = 0, writes = 0;
+	int w, b, seg = 0;
+
+	P(&file_mutex);
+	if (journal_on)
+		seg = journal_rotate();
+	for (w = 0; w < (total_stock_num + 63) / 64; w++)
+	{
+		// Clear the word before reading the records, so a trade that lands after
+		// this point marks its record again and is picked up by the next flush.
+		unsigned long bits = __atomic_exchange_n(&dirty_map[w], 0UL, __ATOMIC_ACQUIRE);
+
+		while (bits)
+		{
+			b = __builtin_ctzl(bits);
+			bits &= bits - 1;
+			int idx = w * 64 + b;
+
+			if (run_len > 0 && (idx != run_start + run_len || (run_len + 1) * RECORD_LEN > sizeof(buf)))
+			{
+				if (pwrite(record_fd, buf, run_len * RECORD_LEN, (off_t)run_start * RECORD_LEN) < 0)
+					unix_error("pwrite error");
+				writes++;
+				run_len = 0;
+			}
+			if (run_len == 0)
+				run_start = idx;
+			format_record(stock_by_idx[idx], buf + run_len * RECORD_LEN);
+			run_len++;
+			records++;
+		}
+	}
+	if (run_len > 0)
+	{
+		if (pwrite(record_fd, buf, run_len * RECORD_LEN, (off_t)run_start * RECORD_LEN) < 0)
+			unix_error("pwrite error");
+		writes++;
+	}
+	if (journal_on)
+	{
+		if (fdatasync(record_fd) < 0)
+			unix_error("fdatasync error");
+		journal_drop_before(seg);
+	}
+	V(&file_mutex);
+
+	if (records > 0)
+		printf("[flush] %d records in %d pwrites\n", records, writes);
+}
+
+// Switch stock.txt to the fixed-width layout: size it to one record per node
+// and mark every node dirty so the first flush writes all of them.
+static void open_record_file()
+{
+	int w;
+
+	record_fd = Open("stock.txt", O_WRONLY, 0);
+	if (ftruncate(record_fd, (off_t)total_stock_num * RECORD_LEN) < 0)
+		unix_error("ftruncate error");
+	for (w = 0; w < total_stock_num / 64; w++)
+		dirty_map[w] = ~0UL;
+	if (total_stock_num % 64)
+		dirty_map[w] = (1UL << (total_stock_num % 64)) - 1;
+	flush_dirty();
+}
+
+// Apply one journal record during recovery. Replay threads own disjoint
+// instruments, and no client is connected yet, so no lock is needed.
+static void recover_apply(int stock_id, int left_stock)
+{
+	STOCK_ITEM* ptr = find_stock(stock_id);
+
+	if (ptr)
+		ptr->left_stock = left_stock;
+}
+
+// Bring the store from the last checkpoint up to the last journaled order.
+// stock.snap, when present, is newer than stock.txt for every instrument it lists.
+static void recover()
+{
+	struct timeval start, end;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	snap_rec_t* snap;
+	int i, snap_seg = 0, nsnap;
+	long n;
+
+	gettimeofday(&start, NULL);
+	if ((nsnap = snapshot_load(&snap, &snap_seg)) >= 0)
+	{
+		for (i = 0; i < nsnap; i++)
+			recover_apply(snap[i].stock_id, snap[i].left_stock);
+		Free(snap);
+	}
+	n = journal_replay(recover_apply, nthreads, snap_seg);
+	gettimeofday(&end, NULL);
+	printf("[recovery] replayed %ld orders with %d threads in %ld us\n", n, nthreads,
+		(end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec));
+	journal_open(cfg.durability);
+
+	if (compact_bytes > 0)
+	{
+		snap = Malloc(sizeof(snap_rec_t) * total_stock_num);
+		for (i = 0; i < total_stock_num; i++)   // stock_by_idx is in stock_id order
+		{
+			snap[i].stock_id = stock_by_idx[i]->stock_id;
+			snap[i].left_stock = stock_by_idx[i]->left_stock;
+			snap[i].stock_price = stock_by_idx[i]->stock_price;
+		}
+		journal_compact_start(snap, total_stock_num);
+		Free(snap);
+	}
+	else if (nsnap >= 0)
+	{
+		rewrite_file();   // Move the state of record back to stock.txt before the snapshot goes
+		snapshot_remove();
+	}
+}
+
+// Durability memory keeps no journal, but a journaled run before this one may
+// have left stock.snap and segments behind after a crash. Fold them into
+// stock.txt and remove them, so this run starts from the last journaled state
+// and a later journaled run does not replay them over this one's orders.
+static void fold_journal()
+{
+	snap_rec_t* snap;
+	int i, snap_seg = 0, nsnap;
+	long n;
+
+	if ((nsnap = snapshot_load(&snap, &snap_seg)) >= 0)
+	{
+		for (i = 0; i < nsnap; i++)
+			recover_apply(snap[i].stock_id, snap[i].left_stock);
+		Free(snap);
+	}
+	n = journal_replay(recover_apply, 1, snap_seg);
+	if (nsnap >= 0 || n > 0)
+	{
+		rewrite_file();
+		printf("[recovery] folded %ld journaled orders into stock.txt, durability memory keeps no journal\n", n);
+	}
+	snapshot_remove();
+	journal_drop_before(INT_MAX);
+}
+
+// Load stock.txt and the accounts file, recover the journal if there is one
+// and start the threads the configuration asks for
+void engine_open(engine_config_t* config)
+{
+	struct timespec ts;
+	pthread_t tid;
+	int i;
+
+	cfg = *config;
+	combine_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? COMBINE_SPIN : 0;
+	load_stock_to_memory();
+	clock_gettime(CLOCK_REALTIME, &ts);
+	change_seq = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	for (i = 0; i < total_stock_num; i++)
+		stock_by_idx[i]->stock_seq = change_seq;   // Everything is news to a cursor from before the open
+	account_init();
+	Sem_init(&file_mutex, 0, 1);
+	journal_on = cfg.durability != DURABILITY_MEMORY;
+	if (journal_on && cfg.accounts && access(cfg.accounts, F_OK) == 0)
+		printf("[accounts] %s left alone: accounts are not journaled, open them with durability memory\n", cfg.accounts);
+	else if (!journal_on && cfg.accounts)
+		load_accounts();
+	if (journal_on)
+		recover();
+	else
+		fold_journal();
+	Sem_init(&snapshot_req, 0, 0);
+	if (cfg.mode == ENGINE_SEQUENCER)
+	{
+		Sem_init(&multi_mutex, 0, 1);
+		if (cfg.net_us > 0)
+			net_head = (STOCK_ITEM**)calloc(cfg.shards, sizeof(STOCK_ITEM*));
+		seq_init(cfg.shards, order_apply, order_flush, cfg.net_us * 1000L);
+	}
+	if (cfg.persist == PERSIST_FORK)
+		Pthread_create(&tid, NULL, snapshot_thread, NULL);
+	else if (cfg.persist == PERSIST_PWRITE)
+		open_record_file();
+}
+
+// Bring stock.txt up to date. In fork mode this only asks the snapshot thread
+// for a snapshot, so the caller does no disk work.
+void engine_checkpoint()
+{
+	if (cfg.persist == PERSIST_FORK)
+		V(&snapshot_req);
+	else if (cfg.persist == PERSIST_PWRITE)
+		flush_dirty();
+	else
+		rewrite_file();
+}
+
+// Write the final state before exit, synchronously whatever the persist mode
+void engine_flush()
+{
+	if (snapshot_pid > 0)     // No need to wait for a stale snapshot: rewrite_file() runs once it is reaped
+		kill(snapshot_pid, SIGKILL);
+	if (journal_on)
+		journal_compact_stop();   // The write below retires stock.snap and the whole journal before it
+	if (cfg.persist == PERSIST_PWRITE)
+		flush_dirty();
+	else
+		rewrite_file();
+	if (!journal_on && cfg.accounts && (account_count() > 0 || access(cfg.accounts, F_OK) == 0))
+		save_accounts();
+}
+
+// Free the store. Nothing may call into the engine any more.
+void engine_close()
+{
+	free_tree(root);
+	root = NULL;
+	free(stock_by_idx);
+	free(dirty_map);
+	account_free();
+}
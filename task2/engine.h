@@ -0,0 +1,127 @@
+/*
+ * engine.h - the stock store and its orders, without any sockets
+ *
+ * Everything both servers do to the store goes through these calls. They take
+ * plain arguments, return RESULT_* from proto.h and fill buffers the caller
+ * owns, so a benchmark or a fuzzer can drive the engine at memory speed. Built
+ * as libstockengine.a; the program that links it brings its own csapp.
+ *
+ * Instruments are loaded from stock.txt in the working directory by
+ * engine_open(). After that every call is thread safe except engine_close().
+ * Once it returns, stock.txt is written only by engine_checkpoint() and
+ * engine_flush(), so a benchmark that calls neither leaves it as it was.
+ *
+ * Orders can be placed for an account. A buy then also needs the cash for
+ * stock_num at stock_price, and a sell needs the position; the instrument, the
+ * cash and the position change together or not at all. Accounts are not
+ * journaled: they are read at open and written by engine_flush() only, so
+ * they are refused unless durability is memory.
+ *
+ * In the locked engine an instrument whose writer semaphore is waited on for
+ * longer than combine_ns on average turns hot: its buys and sells are then
+ * published to a combining array and applied in bulk by whichever thread holds
+ * the semaphore, until holds find too few of them to be worth it.
+ *
+ * The sequencer engine can net orders instead: with net_us set, each shard
+ * holds the results of its orders for up to net_us from the first one on, and
+ * then writes the net change of every instrument they touched as a single
+ * update. Each order is still accepted or rejected exactly as it would be
+ * alone in arrival order, and nobody is answered, nor sees the new
+ * left_stock, before that update; orders for an account move its cash and
+ * positions as they are accepted, though. Every order pays up to net_us of
+ * latency for one change number, journal record and watch update per
+ * instrument and window.
+ */
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include "csapp.h"
+#include "proto.h"
+#include "journal.h"
+#include "book.h"
+#include "account.h"
+
+#define PERSIST_REWRITE 0    // Rewrite stock.txt in place, holding each node's reader lock
+#define PERSIST_FORK    1    // Fork and let the child serialize its copy-on-write image
+#define PERSIST_PWRITE  2    // pwrite only the fixed-width records that changed since the last flush
+
+#define ENGINE_LOCKED    0   // Callers apply orders themselves under each instrument's writer semaphore
+#define ENGINE_SEQUENCER 1   // Callers publish orders to the sequencer of the instrument's shard, see sequencer.h
+
+#define ORDER_BUY  1
+#define ORDER_SELL 2
+
+#define BATCH_MAX  1024   // Orders per engine_batch()
+#define MULTI_MAX  16     // Legs per engine_multi()
+#define BOOK_DEPTH 5      // Price levels per side reported by engine_book()
+
+#define COMBINE_NS 1000   // Default combine_ns: a futex handoff or more per order on average
+
+#define ACCOUNT_NONE 0    // Orders for it are charged to no account and only checked against left_stock
+
+// Called with the stock_idx of an instrument after an order changed it, outside its lock
+typedef void engine_changed_t(int idx);
+
+typedef struct {
+	int persist;                // PERSIST_*
+	int durability;             // DURABILITY_*, anything but memory journals every order and recovers at open
+	int mode;                   // ENGINE_LOCKED or ENGINE_SEQUENCER
+	int shards;                 // Sequencer threads; instrument stock_idx goes to shard stock_idx % shards
+	engine_changed_t* changed;  // NULL if nobody needs to know
+	char* accounts;             // Accounts file read at open and written by engine_flush(), NULL to keep them in memory; unused unless durability is memory
+	int combine_ns;             // Locked engine: writer wait above which an instrument's orders are combined, 0 never
+	int net_us;                 // Sequencer engine: netting window in microseconds, 0 applies each order on its own
+} engine_config_t;
+
+typedef struct {
+	int side;          // ORDER_BUY or ORDER_SELL, anything else is rejected
+	int stock_id;
+	int stock_num;
+	int result;        // RESULT_*, filled in by the engine
+} engine_order_t;
+
+typedef struct {
+	int stock_id;
+	int left_stock;
+	int stock_price;
+} engine_stock_t;
+
+typedef struct {
+	int stock_id;
+	int qty;
+} engine_position_t;
+
+typedef struct {
+	int last_price;                    // Price of the last fill, 0 before the first one
+	int n[2];                          // Levels filled in per side, indexed by SIDE_BID and SIDE_ASK
+	int prices[2][BOOK_DEPTH];         // Best price first
+	long long qtys[2][BOOK_DEPTH];
+} engine_book_t;
+
+void engine_open(engine_config_t* config);
+void engine_checkpoint();
+void engine_flush();
+void engine_close();
+
+int engine_count();
+int engine_find(int stock_id);
+void engine_stock(int idx, engine_stock_t* out);
+void engine_collect(engine_stock_t* out);
+int engine_show_max();
+int engine_show(char* buf);
+int engine_since(long long since, char* buf);
+
+int engine_buy(int account_id, int stock_id, int stock_num);
+int engine_sell(int account_id, int stock_id, int stock_num);
+void engine_batch(int account_id, engine_order_t* orders, int n);
+int engine_multi(int account_id, engine_order_t* legs, int n, int* failed);
+
+int engine_account(int account_id);
+int engine_deposit(int account_id, long long amount, long long* cash);
+int engine_balance(int account_id, long long* cash, engine_position_t* out, int* n);
+
+int engine_limit(int stock_id, int side, int price, int qty, long long* id, int* resting, book_fill_t* fill, void* arg);
+int engine_cancel(int stock_id, long long order_id, int* qty);
+int engine_book(int stock_id, engine_book_t* out);
+
+#endif /* __ENGINE_H__ */
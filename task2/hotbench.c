@@ -0,0 +1,136 @@
+/*
+ * hotbench.c - order throughput of one hot instrument as writers are added
+ *
+ * usage: hotbench [--threads=T] [--orders=N] [--combine-ns=N]
+ *                 [--engine=locked|sequencer] [--net-us=N]
+ *                 [--durability=memory|async|group|sync]
+ *
+ * Runs the engine in this process on stock.txt of the working directory,
+ * which is never written back; any durability but memory journals into the
+ * working directory as well, so run that in a scratch copy. For 1, 2, 4, ...
+ * up to T threads, every thread sends round trips of a buy and a sell of the
+ * same instrument, N orders over all threads, and the orders per second and
+ * the median and 99th percentile time of an order are reported. Run it with
+ * --combine-ns=0 to see the plain writer semaphore and without to see the hot
+ * instrument combined, or with --engine=sequencer and --net-us=N to see the
+ * orders netted.
+ */
+#include "csapp.h"
+#include "engine.h"
+#include <time.h>
+
+int nthreads = 64;
+long orders = 2000000;      // Over all threads of a run, half of them buys
+int hot_id;                 // stock_id every order goes to
+int running;                // Threads of the run
+long rejected = 0;
+long* lat;                  // Time of each order of the run, in ns
+
+long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int long_less(const void* a, const void* b)
+{
+	long x = *(long*)a, y = *(long*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+void* client(void* vargp)
+{
+	long i, n = orders / running / 2, bad = 0, start;
+	long* my = lat + (long)vargp * n * 2;
+
+	for (i = 0; i < n; i++)
+	{
+		start = now_ns();
+		if (engine_buy(ACCOUNT_NONE, hot_id, 1) != RESULT_OK)
+			bad++;
+		my[i * 2] = now_ns() - start;
+		start = now_ns();
+		if (engine_sell(ACCOUNT_NONE, hot_id, 1) != RESULT_OK)
+			bad++;
+		my[i * 2 + 1] = now_ns() - start;
+	}
+	__atomic_add_fetch(&rejected, bad, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+// Orders per second of one run
+double run(int n)
+{
+	pthread_t* tids = Malloc(sizeof(pthread_t) * n);
+	long i, start = now_ns();
+
+	running = n;
+	rejected = 0;
+	for (i = 0; i < n; i++)
+		Pthread_create(&tids[i], NULL, client, (void*)i);
+	for (i = 0; i < n; i++)
+		Pthread_join(tids[i], NULL);
+	Free(tids);
+	return (double)(orders / n / 2 * 2 * n) / ((now_ns() - start) / 1e9);
+}
+
+int main(int argc, char** argv)
+{
+	engine_config_t config = { PERSIST_REWRITE, DURABILITY_MEMORY, ENGINE_LOCKED, 4, NULL, NULL, COMBINE_NS };
+	engine_stock_t s;
+	long total;
+	int i, n;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strncmp(argv[i], "--threads=", 10))
+			nthreads = atoi(argv[i] + 10);
+		else if (!strncmp(argv[i], "--orders=", 9))
+			orders = atol(argv[i] + 9);
+		else if (!strncmp(argv[i], "--combine-ns=", 13))
+			config.combine_ns = atoi(argv[i] + 13);
+		else if (!strcmp(argv[i], "--engine=locked"))
+			config.mode = ENGINE_LOCKED;
+		else if (!strcmp(argv[i], "--engine=sequencer"))
+			config.mode = ENGINE_SEQUENCER;
+		else if (!strncmp(argv[i], "--net-us=", 9))
+			config.net_us = atoi(argv[i] + 9);
+		else if (!strcmp(argv[i], "--durability=memory"))
+			config.durability = DURABILITY_MEMORY;
+		else if (!strcmp(argv[i], "--durability=async"))
+			config.durability = DURABILITY_ASYNC;
+		else if (!strcmp(argv[i], "--durability=group"))
+			config.durability = DURABILITY_GROUP;
+		else if (!strcmp(argv[i], "--durability=sync"))
+			config.durability = DURABILITY_SYNC;
+		else
+		{
+			fprintf(stderr, "usage: %s [--threads=T] [--orders=N] [--combine-ns=N] [--engine=locked|sequencer] [--net-us=N] [--durability=memory|async|group|sync]\n", argv[0]);
+			exit(0);
+		}
+	}
+	if (nthreads < 1)
+		app_error("--threads must be positive");
+	engine_open(&config);
+	engine_stock(0, &s);
+	hot_id = s.stock_id;
+	engine_sell(ACCOUNT_NONE, hot_id, 100000000);   // No buy is turned away for want of stock
+
+	printf("stock %d, %s engine, combine_ns %d, net_us %d\n", hot_id, config.mode == ENGINE_SEQUENCER ? "sequencer" : "locked", config.combine_ns, config.net_us);
+	lat = Malloc(sizeof(long) * orders);
+	for (n = 1; n <= nthreads; n *= 2)
+	{
+		double rate = run(n);
+
+		total = orders / n / 2 * 2 * n;
+		qsort(lat, total, sizeof(long), long_less);
+		printf("%3d threads: %.0f orders/s, p50 %.1f us, p99 %.1f us, %ld rejected\n",
+			n, rate, lat[total / 2] / 1e3, lat[total * 99 / 100] / 1e3, rejected);
+	}
+	Free(lat);
+	engine_close();
+	return 0;
+}
@@ -0,0 +1,565 @@
+/*
+ * journal.c - append-only order journal used for crash recovery
+ *
+ * Orders are appended to stock.journal.<seg>. A checkpoint rotates to a new
+ * segment first, writes the snapshot durably and then drops the old segments,
+ * so after a crash the last snapshot plus the remaining segments always
+ * reproduce the last journaled state.
+ *
+ * With compaction enabled, a background thread instead folds sealed segments
+ * into stock.snap, a compact binary snapshot, without touching the live store.
+ * stock.snap and the segments after it are then the state of record.
+ */
+#include "csapp.h"
+#include "journal.h"
+#include <limits.h>
+
+#define JOURNAL_PREFIX "stock.journal."
+#define SNAPSHOT_FILE  "stock.snap"
+#define SNAPSHOT_MAGIC 0x31504e53   // "SNP1"
+
+int journal_fd = -1;               // Current segment, -1 when journaling is off
+int journal_durability = DURABILITY_MEMORY;
+int group_ms = 2;
+int group_orders = 64;
+long compact_bytes = 64L << 20;
+static int journal_seg = 0;        // Segment number journal_fd points to
+static long long journal_seq = 0;  // Last sequence number handed out
+static int compacting = 0;         // Compactor running: it alone retires segments
+static int compact_stopped = 0;    // journal_compact_stop() called: no more folds, the next drop removes stock.snap
+static pthread_mutex_t compact_mutex = PTHREAD_MUTEX_INITIALIZER;   // Held by a fold, so stopping waits for it
+static pthread_mutex_t rotate_mutex = PTHREAD_MUTEX_INITIALIZER;   // Checkpoints and the compactor both rotate
+
+// Appenders hold it shared around write (and fdatasync in sync mode); rotation
+// holds it exclusively, so no order is still in flight to a segment being retired.
+static pthread_rwlock_t journal_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Group commit. An order that has been written joins the open group; the flusher
+// closes the group, runs one fdatasync for all of its members and wakes them.
+static pthread_mutex_t group_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t group_full = PTHREAD_COND_INITIALIZER;    // Signals the flusher
+static pthread_cond_t group_done = PTHREAD_COND_INITIALIZER;    // Signals waiting orders
+static long long group_open = 0;   // Number of the group new orders join
+static long long group_synced = 0; // Every group below this number is durable
+static int group_waiters = 0;      // Orders in the open group
+
+typedef struct {
+	journal_rec_t* recs;        // All records of all segments, in file order
+	long* idx;                  // Indexes into recs of this thread's records, in file order; NULL for all of recs
+	long n;                     // Number of them
+	journal_apply_t* apply;     // Applies one record to the store
+} replay_arg_t;
+
+static int int_less(const void* a, const void* b)
+{
+	return *(int*)a - *(int*)b;
+}
+
+// Collect the segment numbers present in the working directory, ascending
+static int journal_segments(int** segs)
+{
+	DIR* dir = Opendir(".");
+	struct dirent* de;
+	int n = 0, cap = 16;
+
+	*segs = Malloc(sizeof(int) * cap);
+	while ((de = readdir(dir)) != NULL)
+	{
+		if (strncmp(de->d_name, JOURNAL_PREFIX, strlen(JOURNAL_PREFIX)))
+			continue;
+		if (n == cap)
+			*segs = Realloc(*segs, sizeof(int) * (cap *= 2));
+		(*segs)[n++] = atoi(de->d_name + strlen(JOURNAL_PREFIX));
+	}
+	Closedir(dir);
+	qsort(*segs, n, sizeof(int), int_less);
+	return n;
+}
+
+static void* group_thread(void* vargp)
+{
+	struct timespec deadline;
+	long long group;
+
+	Pthread_detach(pthread_self());
+	while (1)
+	{
+		pthread_mutex_lock(&group_mutex);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += group_ms * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		while (group_waiters < group_orders)
+			if (pthread_cond_timedwait(&group_full, &group_mutex, &deadline) == ETIMEDOUT)
+				break;
+		if (group_waiters == 0)
+		{
+			pthread_mutex_unlock(&group_mutex);
+			continue;
+		}
+		group = group_open++;   // Orders arriving from now on wait for the next fdatasync
+		group_waiters = 0;
+		pthread_mutex_unlock(&group_mutex);
+
+		if (fdatasync(journal_fd) < 0)
+			unix_error("journal fdatasync error");
+
+		pthread_mutex_lock(&group_mutex);
+		group_synced = group + 1;
+		pthread_cond_broadcast(&group_done);
+		pthread_mutex_unlock(&group_mutex);
+	}
+	return NULL;
+}
+
+// Start a fresh segment after the highest one on disk
+void journal_open(int durability)
+{
+	char name[64];
+	int* segs;
+	int n = journal_segments(&segs);
+	pthread_t tid;
+
+	journal_seg = n > 0 ? segs[n - 1] + 1 : 0;
+	Free(segs);
+	sprintf(name, JOURNAL_PREFIX "%d", journal_seg);
+	journal_fd = Open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, DEF_MODE);
+	journal_durability = durability;
+	if (durability == DURABILITY_GROUP)
+		Pthread_create(&tid, NULL, group_thread, NULL);
+}
+
+// Append one order. Called with the instrument's writer lock held, so records of
+// the same instrument reach the file in the order they were applied. Returns the
+// ticket to pass to journal_wait() before the order is acknowledged.
+long long journal_append(int op, int stock_id, int stock_num, int left_stock)
+{
+	journal_rec_t rec;
+
+	rec.stock_id = stock_id;
+	rec.op = op;
+	rec.stock_num = stock_num;
+	rec.left_stock = left_stock;
+	return journal_append_legs(&rec, 1);
+}
+
+// Append the n legs of one order with a single write(), so they land in one
+// segment back to back. Every leg but the last carries JOURNAL_MORE; replay drops
+// a trailing group that was torn before its last leg reached the disk. Called
+// with the writer locks of every instrument involved held. Fills in seq.
+long long journal_append_legs(journal_rec_t* recs, int n)
+{
+	long long ticket = 0, seq = __atomic_add_fetch(&journal_seq, n, __ATOMIC_RELAXED) - n;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		recs[i].seq = ++seq;
+		if (i < n - 1)
+			recs[i].op |= JOURNAL_MORE;
+	}
+
+	pthread_rwlock_rdlock(&journal_lock);
+	if (write(journal_fd, recs, sizeof(journal_rec_t) * n) != sizeof(journal_rec_t) * n)
+		unix_error("journal write error");
+	pthread_rwlock_unlock(&journal_lock);
+
+	if (journal_durability == DURABILITY_GROUP)
+	{
+		pthread_mutex_lock(&group_mutex);
+		ticket = group_open;
+		if (++group_waiters == group_orders)
+			pthread_cond_signal(&group_full);
+		pthread_mutex_unlock(&group_mutex);
+	}
+	return ticket;
+}
+
+// Block until the order behind ticket is durable. Called after the instrument
+// locks are released, so no fdatasync runs while other orders on the same
+// instrument wait. Async mode never waits; in sync mode each order syncs the
+// segment itself, which also covers every record written before it.
+void journal_wait(long long ticket)
+{
+	if (journal_durability == DURABILITY_SYNC)
+	{
+		pthread_rwlock_rdlock(&journal_lock);   // journal_rotate() syncs the old segment before swapping it
+		if (fdatasync(journal_fd) < 0)
+			unix_error("journal fdatasync error");
+		pthread_rwlock_unlock(&journal_lock);
+		return;
+	}
+	if (journal_durability != DURABILITY_GROUP)
+		return;
+	pthread_mutex_lock(&group_mutex);
+	while (group_synced <= ticket)
+		pthread_cond_wait(&group_done, &group_mutex);
+	pthread_mutex_unlock(&group_mutex);
+}
+
+// Redirect appenders to a new segment and return its number. Every segment below
+// the returned number is covered by a snapshot started after this call. Orders
+// still waiting for a group commit or their own sync are in the old segment, so
+// it is synced here before the next fdatasync moves on to the new one.
+int journal_rotate()
+{
+	char name[64];
+	int fd, seg;
+
+	pthread_mutex_lock(&rotate_mutex);
+	sprintf(name, JOURNAL_PREFIX "%d", journal_seg + 1);
+	fd = Open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, DEF_MODE);
+	pthread_rwlock_wrlock(&journal_lock);
+	if ((journal_durability == DURABILITY_GROUP || journal_durability == DURABILITY_SYNC) && fdatasync(journal_fd) < 0)
+		unix_error("journal fdatasync error");
+	Dup2(fd, journal_fd);
+	pthread_rwlock_unlock(&journal_lock);
+	Close(fd);
+	seg = ++journal_seg;
+	pthread_mutex_unlock(&rotate_mutex);
+	return seg;
+}
+
+static void drop_segments_before(int seg)
+{
+	char name[64];
+	int* segs;
+	int i, n = journal_segments(&segs);
+
+	for (i = 0; i < n && segs[i] < seg; i++)
+	{
+		sprintf(name, JOURNAL_PREFIX "%d", segs[i]);
+		unlink(name);
+	}
+	Free(segs);
+}
+
+// Remove the segments a durable snapshot has made redundant. While the compactor
+// runs, recovery starts from stock.snap rather than stock.txt, so only the
+// compactor may retire segments. Once it has been stopped, the snapshot that
+// calls this holds everything stock.snap does: stock.snap goes first, so a
+// crash in between replays the remaining segments over that snapshot, never
+// stock.snap over it.
+void journal_drop_before(int seg)
+{
+	if (compacting && compact_stopped)
+	{
+		snapshot_remove();
+		compacting = 0;
+	}
+	if (!compacting)
+		drop_segments_before(seg);
+}
+
+static void* replay_thread(void* vargp)
+{
+	replay_arg_t* arg = (replay_arg_t*)vargp;
+	long i;
+
+	for (i = 0; i < arg->n; i++)
+	{
+		journal_rec_t* rec = &arg->recs[arg->idx ? arg->idx[i] : i];
+		arg->apply(rec->stock_id, rec->left_stock);
+	}
+	return NULL;
+}
+
+// Read the records of segments from_seg <= seg < to_seg, in order
+static journal_rec_t* journal_read(int from_seg, int to_seg, long* count)
+{
+	char name[64];
+	int* segs;
+	int i, nsegs = journal_segments(&segs);
+	journal_rec_t* recs = NULL;
+	long n = 0;
+	struct stat st;
+
+	for (i = 0; i < nsegs; i++)
+	{
+		if (segs[i] < from_seg || segs[i] >= to_seg)
+			continue;
+		sprintf(name, JOURNAL_PREFIX "%d", segs[i]);
+		int fd = Open(name, O_RDONLY, 0);
+		Fstat(fd, &st);
+		long cnt = st.st_size / sizeof(journal_rec_t);   // A torn trailing record is ignored
+		recs = Realloc(recs, sizeof(journal_rec_t) * (n + cnt + 1));
+		if (Rio_readn(fd, recs + n, cnt * sizeof(journal_rec_t)) != cnt * sizeof(journal_rec_t))
+			app_error("journal segment shrank during replay");
+		Close(fd);
+		while (cnt > 0 && recs[n + cnt - 1].op & JOURNAL_MORE)
+			cnt--;   // Legs of a multi-leg order whose last leg never made it
+		n += cnt;
+	}
+	Free(segs);
+	*count = n;
+	return recs;
+}
+
+// Replay every segment from from_seg on. Instruments are partitioned across
+// nthreads threads by stock_id % nthreads; one pass over the records lists
+// each thread's own, which it applies in journal order, so orders on
+// different instruments replay in parallel. Returns the number of records.
+long journal_replay(journal_apply_t* apply, int nthreads, int from_seg)
+{
+	long i, n, *idx, *start;
+	pthread_t* tids;
+	replay_arg_t* args;
+	journal_rec_t* recs = journal_read(from_seg, INT_MAX, &n);
+
+	for (i = 0; i < n; i++)   // Writers append out of seq order, so the last record need not hold the largest
+		if (recs[i].seq > journal_seq)
+			journal_seq = recs[i].seq;   // Keep sequence numbers increasing across restarts
+
+	if (nthreads <= 1)   // No lists to make: this thread takes every record
+	{
+		replay_arg_t one = { recs, NULL, n, apply };
+
+		replay_thread(&one);
+		Free(recs);
+		return n;
+	}
+	tids = Malloc(sizeof(pthread_t) * nthreads);
+	args = Malloc(sizeof(replay_arg_t) * nthreads);
+	idx = Malloc(sizeof(long) * (n + 1));
+	start = Calloc(nthreads + 1, sizeof(long));
+	for (i = 0; i < n; i++)   // Count each thread's records, then lay out their lists back to back
+		start[(unsigned int)recs[i].stock_id % nthreads + 1]++;
+	for (i = 0; i < nthreads; i++)
+	{
+		start[i + 1] += start[i];
+		args[i].recs = recs;
+		args[i].idx = idx + start[i];
+		args[i].n = 0;
+		args[i].apply = apply;
+	}
+	for (i = 0; i < n; i++)
+	{
+		replay_arg_t* arg = &args[(unsigned int)recs[i].stock_id % nthreads];
+		arg->idx[arg->n++] = i;
+	}
+	for (i = 0; i < nthreads; i++)
+		Pthread_create(&tids[i], NULL, replay_thread, &args[i]);
+	for (i = 0; i < nthreads; i++)
+		Pthread_join(tids[i], NULL);
+
+	Free(tids);
+	Free(args);
+	Free(idx);
+	Free(start);
+	Free(recs);
+	return n;
+}
+
+static unsigned char* put_varint(unsigned char* p, unsigned int v)
+{
+	while (v >= 0x80)
+	{
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static unsigned char* get_varint(unsigned char* p, unsigned char* end, unsigned int* v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 35)
+	{
+		*v |= (unsigned int)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;   // Truncated or corrupt
+}
+
+// Small negative numbers get small codes too: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+static unsigned int zigzag(int v)
+{
+	return ((unsigned int)v << 1) ^ (unsigned int)(v >> 31);
+}
+
+static int unzigzag(unsigned int v)
+{
+	return (int)(v >> 1) ^ -(int)(v & 1);
+}
+
+// Write stock.snap covering every segment below seg. recs must be sorted by
+// stock_id. Layout: magic, then varints seg, n, and per record the stock_id
+// delta to the previous record, left_stock and stock_price, all zigzag coded.
+// Sorted IDs make the deltas one byte each for a dense catalog. Returns the size.
+long snapshot_save(snap_rec_t* recs, int n, int seg)
+{
+	unsigned char* buf = Malloc(16 + (long)n * 15);
+	unsigned char* p = buf;
+	unsigned int magic = SNAPSHOT_MAGIC;
+	int i, fd, prev_id = 0;
+	long len;
+
+	memcpy(p, &magic, sizeof(magic));
+	p = put_varint(p + sizeof(magic), seg);
+	p = put_varint(p, n);
+	for (i = 0; i < n; i++)
+	{
+		p = put_varint(p, zigzag(recs[i].stock_id - prev_id));
+		p = put_varint(p, zigzag(recs[i].left_stock));
+		p = put_varint(p, zigzag(recs[i].stock_price));
+		prev_id = recs[i].stock_id;
+	}
+	len = p - buf;
+
+	fd = Open(SNAPSHOT_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, DEF_MODE);
+	Rio_writen(fd, buf, len);
+	if (fsync(fd) < 0)
+		unix_error("snapshot fsync error");
+	Close(fd);
+	if (rename(SNAPSHOT_FILE ".tmp", SNAPSHOT_FILE) < 0)
+		unix_error("snapshot rename error");
+	Free(buf);
+	return len;
+}
+
+// Load stock.snap. Returns the number of records, or -1 if there is no usable
+// snapshot; *seg is the first segment the snapshot does not cover.
+int snapshot_load(snap_rec_t** recs, int* seg)
+{
+	unsigned char *buf, *p, *end;
+	unsigned int magic, v = 0, n = 0, i;
+	int prev_id = 0, fd = open(SNAPSHOT_FILE, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0)
+		return -1;
+	Fstat(fd, &st);
+	buf = Malloc(st.st_size + 1);
+	if (Rio_readn(fd, buf, st.st_size) != st.st_size || st.st_size < sizeof(magic))
+		app_error("stock.snap truncated");
+	Close(fd);
+
+	memcpy(&magic, buf, sizeof(magic));
+	end = buf + st.st_size;
+	if (magic != SNAPSHOT_MAGIC || !(p = get_varint(buf + sizeof(magic), end, &v)) || !(p = get_varint(p, end, &n)))
+		app_error("stock.snap corrupt");
+	*seg = v;
+	*recs = Malloc(sizeof(snap_rec_t) * (n + 1));
+	for (i = 0; i < n; i++)
+	{
+		if (!(p = get_varint(p, end, &v)))
+			app_error("stock.snap corrupt");
+		(*recs)[i].stock_id = prev_id = prev_id + unzigzag(v);
+		if (!(p = get_varint(p, end, &v)))
+			app_error("stock.snap corrupt");
+		(*recs)[i].left_stock = unzigzag(v);
+		if (!(p = get_varint(p, end, &v)))
+			app_error("stock.snap corrupt");
+		(*recs)[i].stock_price = unzigzag(v);
+	}
+	Free(buf);
+	return n;
+}
+
+void snapshot_remove()
+{
+	unlink(SNAPSHOT_FILE);
+}
+
+static int snap_rec_less(const void* key, const void* rec)
+{
+	return *(int*)key - ((snap_rec_t*)rec)->stock_id;
+}
+
+// Fold every sealed segment into a new stock.snap. Works on files only: the
+// previous snapshot plus the sealed records give the new one, so trading is
+// only paused by the rotation itself.
+static void journal_compact()
+{
+	struct timeval start, end;
+	snap_rec_t* snap;
+	journal_rec_t* recs;
+	int seg, new_seg, n;
+	long i, nrecs, len;
+
+	gettimeofday(&start, NULL);
+	if ((n = snapshot_load(&snap, &seg)) < 0)
+		app_error("stock.snap missing while compacting");
+	new_seg = journal_rotate();
+	recs = journal_read(seg, new_seg, &nrecs);
+	for (i = 0; i < nrecs; i++)
+	{
+		snap_rec_t* rec = bsearch(&recs[i].stock_id, snap, n, sizeof(snap_rec_t), snap_rec_less);
+		if (rec)
+			rec->left_stock = recs[i].left_stock;
+	}
+	len = snapshot_save(snap, n, new_seg);
+	drop_segments_before(new_seg);
+	gettimeofday(&end, NULL);
+
+	printf("[compact] folded %ld orders into a %ld byte snapshot in %ld us\n", nrecs, len,
+		(end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec));
+	Free(recs);
+	Free(snap);
+}
+
+// Bytes of journal not yet folded into stock.snap
+static long journal_bytes()
+{
+	char name[64];
+	int* segs;
+	int i, n = journal_segments(&segs);
+	long bytes = 0;
+	struct stat st;
+
+	for (i = 0; i < n; i++)
+	{
+		sprintf(name, JOURNAL_PREFIX "%d", segs[i]);
+		if (stat(name, &st) == 0)
+			bytes += st.st_size;
+	}
+	Free(segs);
+	return bytes;
+}
+
+static void* compact_thread(void* vargp)
+{
+	Pthread_detach(pthread_self());
+	while (1)
+	{
+		usleep(100000);
+		pthread_mutex_lock(&compact_mutex);
+		if (compact_stopped)
+		{
+			pthread_mutex_unlock(&compact_mutex);
+			return NULL;
+		}
+		if (journal_bytes() >= compact_bytes)
+			journal_compact();
+		pthread_mutex_unlock(&compact_mutex);
+	}
+	return NULL;
+}
+
+// Stop compacting for good before the final checkpoint, which then takes
+// stock.snap and the segments it covered away with it: a run after this one
+// that keeps no journal must find nothing newer than stock.txt.
+void journal_compact_stop()
+{
+	pthread_mutex_lock(&compact_mutex);
+	compact_stopped = 1;
+	pthread_mutex_unlock(&compact_mutex);
+}
+
+// Write the first stock.snap from the recovered store, retire the segments it
+// covers and start compacting whenever the journal grows to compact_bytes.
+// Call after journal_open(); recs must be sorted by stock_id.
+void journal_compact_start(snap_rec_t* recs, int n)
+{
+	pthread_t tid;
+
+	snapshot_save(recs, n, journal_seg);
+	drop_segments_before(journal_seg);
+	compacting = 1;
+	Pthread_create(&tid, NULL, compact_thread, NULL);
+}
@@ -0,0 +1,56 @@
+/*
+ * journal.h - append-only order journal used for crash recovery
+ */
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#define JOURNAL_BUY  1
+#define JOURNAL_SELL 2
+#define JOURNAL_MORE 4    // Or'ed into op: the next record is another leg of the same multi-leg order
+
+#define DURABILITY_MEMORY 0    // No journal, state survives only through checkpoints
+#define DURABILITY_ASYNC  1    // write() each order, the kernel flushes it when it likes
+#define DURABILITY_GROUP  2    // Orders wait for a shared fdatasync every group_ms or group_orders
+#define DURABILITY_SYNC   3    // fdatasync before every order is acknowledged
+
+// One journaled order. left_stock is the value after the order was applied, so
+// replaying a record is idempotent: records already covered by the checkpoint
+// just set the instrument to a state that later records overwrite.
+typedef struct {
+	long long seq;     // Global order sequence number
+	int stock_id;      // Instrument the order touched
+	int op;            // JOURNAL_BUY or JOURNAL_SELL
+	int stock_num;     // Quantity of the order
+	int left_stock;    // left_stock after the order
+} journal_rec_t;
+
+// One instrument in a compacted snapshot
+typedef struct {
+	int stock_id;
+	int left_stock;
+	int stock_price;
+} snap_rec_t;
+
+typedef void journal_apply_t(int stock_id, int left_stock);
+
+extern int journal_fd;            // Current segment, -1 when journaling is off
+extern int journal_durability;    // One of DURABILITY_*
+extern int group_ms;              // Group commit interval
+extern int group_orders;          // Group commit early once this many orders wait
+extern long compact_bytes;        // Fold the journal into stock.snap once it is this large, 0 to disable
+
+void journal_open(int durability);
+long long journal_append(int op, int stock_id, int stock_num, int left_stock);
+long long journal_append_legs(journal_rec_t* recs, int n);
+void journal_wait(long long ticket);
+int journal_rotate();
+void journal_drop_before(int seg);
+long journal_replay(journal_apply_t* apply, int nthreads, int from_seg);
+
+long snapshot_save(snap_rec_t* recs, int n, int seg);
+int snapshot_load(snap_rec_t** recs, int* seg);
+void snapshot_remove();
+void journal_compact_start(snap_rec_t* recs, int n);
+void journal_compact_stop();
+
+#endif /* __JOURNAL_H__ */
@@ -0,0 +1,98 @@
+/*
+ * limit.c - command rate limits, see limit.h
+ *
+ * A bucket of rate tokens per second holding burst of them is full at time
+ * full_at. Taking cost tokens moves full_at to max(full_at, now) + cost
+ * intervals, which is allowed as long as that stays within burst intervals
+ * of now.
+ */
+#include "limit.h"
+#include <time.h>
+
+static long conn_interval = 0;    // ns per token of a connection bucket, 0 for no limit
+static long ip_interval = 0;      // Likewise for an address bucket
+static int bucket_size = LIMIT_BURST;
+static long ip_full_at[LIMIT_IP_SLOTS];
+
+static long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// full_at after taking cost tokens from a bucket full at full_at, or -1 if it
+// does not have them
+static long take(long full_at, long now, long interval, int cost)
+{
+	long next = (full_at > now ? full_at : now) + cost * interval;
+
+	return next - now <= bucket_size * interval ? next : -1;
+}
+
+// Limit every connection to conn_rate commands per second and every client
+// address to ip_rate, 0 for no limit, with buckets of burst commands
+void limit_init(int conn_rate, int ip_rate, int burst)
+{
+	conn_interval = conn_rate > 0 ? 1000000000L / conn_rate : 0;
+	ip_interval = ip_rate > 0 ? 1000000000L / ip_rate : 0;
+	bucket_size = burst > 0 ? burst : LIMIT_BURST;
+}
+
+// Give the connection on fd a full bucket and find the one of its address
+void limit_open(limit_t* l, int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	unsigned int h = 0;
+	unsigned char* p = NULL;
+	int i, n = 0;
+
+	l->full_at = 0;
+	l->ip_slot = -1;
+	if (ip_interval == 0 || getpeername(fd, (SA*)&addr, &len) < 0)
+		return;
+	if (addr.ss_family == AF_INET)
+	{
+		p = (unsigned char*)&((struct sockaddr_in*)&addr)->sin_addr;
+		n = 4;
+	}
+	else if (addr.ss_family == AF_INET6)
+	{
+		p = (unsigned char*)&((struct sockaddr_in6*)&addr)->sin6_addr;
+		n = 16;
+	}
+	for (i = 0; i < n; i++)   // FNV-1a
+		h = (h ^ p[i]) * 16777619u;
+	if (n > 0)
+		l->ip_slot = (h ^ (h >> 16)) & (LIMIT_IP_SLOTS - 1);
+}
+
+// Take cost tokens for one command from the connection's bucket and from its
+// address's. Returns 1 if both had them, and 0, taking none, if either did
+// not. A cost above the bucket size is charged as a full bucket.
+int limit_take(limit_t* l, int cost)
+{
+	long now, conn_next = 0, seen, next;
+
+	if (conn_interval == 0 && (ip_interval == 0 || l->ip_slot < 0))
+		return 1;
+	if (cost > bucket_size)
+		cost = bucket_size;
+	now = now_ns();
+	if (conn_interval && (conn_next = take(l->full_at, now, conn_interval, cost)) < 0)
+		return 0;
+	if (ip_interval && l->ip_slot >= 0)
+	{
+		seen = __atomic_load_n(&ip_full_at[l->ip_slot], __ATOMIC_RELAXED);
+		do
+		{
+			if ((next = take(seen, now, ip_interval, cost)) < 0)
+				return 0;
+		} while (!__atomic_compare_exchange_n(&ip_full_at[l->ip_slot], &seen, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+	if (conn_interval)
+		l->full_at = conn_next;
+	return 1;
+}
@@ -0,0 +1,28 @@
+/*
+ * limit.h - command rate limits per connection and per client address
+ *
+ * Every connection has a token bucket, and so has every client address; a
+ * command is admitted only if both have a token for it. A bucket is kept the
+ * GCRA way, as the one time at which it will be full again, so taking a token
+ * is a clock read and a compare, and an address bucket shared by workers is
+ * updated with a single compare-and-swap. Addresses hash into a fixed table
+ * of LIMIT_IP_SLOTS buckets; two addresses that collide share a budget.
+ */
+#ifndef __LIMIT_H__
+#define __LIMIT_H__
+
+#include "csapp.h"
+
+#define LIMIT_IP_SLOTS 4096    // Address buckets, a power of two
+#define LIMIT_BURST    100     // Default tokens a full bucket holds
+
+typedef struct {
+	long full_at;              // CLOCK_MONOTONIC ns at which the connection's bucket is full again
+	int ip_slot;               // Bucket of the client address, -1 for none (AF_UNIX)
+} limit_t;
+
+void limit_init(int conn_rate, int ip_rate, int burst);
+void limit_open(limit_t* l, int fd);
+int limit_take(limit_t* l, int cost);
+
+#endif /* __LIMIT_H__ */
@@ -0,0 +1,285 @@
+/*
+ * parse.c - single-pass parser for the text protocol
+ *
+ * Lines are parsed where they sit in the connection's rio buffer: no copy into
+ * a line buffer, no sscanf and no strcmp chain. The verb is dispatched on its
+ * first byte and length, and integers are accumulated digit by digit.
+ */
+#include <limits.h>
+#include "parse.h"
+
+static const char* skip_space(const char* p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		p++;
+	return p;
+}
+
+// Parse an optionally signed decimal integer that must end at whitespace or at
+// the end of the line. Returns the position after it, or NULL if there is none.
+static const char* parse_ll(const char* p, const char* end, long long* out)
+{
+	unsigned long long v = 0;
+	int neg = 0;
+	const char* digits;
+
+	p = skip_space(p, end);
+	if (p < end && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+	for (digits = p; p < end && (unsigned int)(*p - '0') < 10; p++)
+	{
+		if (v > ((unsigned long long)LLONG_MAX - (*p - '0')) / 10)   // Would not fit, rather than wrap
+			return NULL;
+		v = v * 10 + (*p - '0');
+	}
+	if (p == digits || (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'))
+		return NULL;
+	*out = neg ? -(long long)v : (long long)v;
+	return p;
+}
+
+const char* parse_int(const char* p, const char* end, int* out)
+{
+	long long v;
+
+	if ((p = parse_ll(p, end, &v)) == NULL || v < INT_MIN || v > INT_MAX)   // "4294967301" is not 5
+		return NULL;
+	*out = (int)v;
+	return p;
+}
+
+// Parse one command line of len bytes (the newline included or not) into cmd.
+// The command may be preceded by a request tag, "#<tag> ".
+void parse_command(const char* line, int len, command_t* cmd)
+{
+	const char* end = line + len;
+	const char* verb = skip_space(line, end);
+	const char* p;
+	int verb_len;
+
+	cmd->tagged = 0;
+	if (verb < end && *verb == '#')
+	{
+		if ((p = parse_ll(verb + 1, end, &cmd->tag)) == NULL || cmd->tag < 0 || verb[1] == ' ')
+		{
+			cmd->verb = CMD_INVALID;
+			return;
+		}
+		cmd->tagged = 1;
+		verb = skip_space(p, end);
+	}
+	p = verb;
+
+	while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+		p++;
+	verb_len = p - verb;
+
+	cmd->verb = CMD_INVALID;
+	switch (verb_len == 0 ? 0 : verb[0])
+	{
+	case 0:
+		cmd->verb = CMD_EMPTY;
+		return;
+	case 'b':
+		if (verb_len == 3 && verb[1] == 'u' && verb[2] == 'y')
+			cmd->verb = CMD_BUY;
+		else if (verb_len == 6 && !memcmp(verb, "binary", 6))
+			cmd->verb = CMD_BINARY;
+		else if (verb_len == 5 && !memcmp(verb, "batch", 5))
+			cmd->verb = CMD_BATCH;
+		else if (verb_len == 3 && verb[1] == 'i' && verb[2] == 'd')
+			cmd->verb = CMD_BID;
+		else if (verb_len == 4 && !memcmp(verb, "book", 4))
+			cmd->verb = CMD_BOOK;
+		else if (verb_len == 7 && !memcmp(verb, "balance", 7))
+			cmd->verb = CMD_BALANCE;
+		break;
+	case 'a':
+		if (verb_len == 3 && verb[1] == 's' && verb[2] == 'k')
+			cmd->verb = CMD_ASK;
+		else if (verb_len == 7 && !memcmp(verb, "account", 7))
+			cmd->verb = CMD_ACCOUNT;
+		break;
+	case 'd':
+		if (verb_len == 7 && !memcmp(verb, "deposit", 7))
+			cmd->verb = CMD_DEPOSIT;
+		break;
+	case 'c':
+		if (verb_len == 6 && !memcmp(verb, "cancel", 6))
+			cmd->verb = CMD_CANCEL;
+		break;
+	case 's':
+		if (verb_len == 4 && !memcmp(verb, "sell", 4))
+			cmd->verb = CMD_SELL;
+		else if (verb_len == 4 && !memcmp(verb, "show", 4))
+			cmd->verb = CMD_SHOW;
+		else if (verb_len == 3 && verb[1] == 'h' && verb[2] == 'm')
+			cmd->verb = CMD_SHM;
+		break;
+	case 'm':
+		if (verb_len == 5 && !memcmp(verb, "multi", 5))
+			cmd->verb = CMD_MULTI;
+		break;
+	case 'w':
+		if (verb_len == 5 && !memcmp(verb, "watch", 5))
+			cmd->verb = CMD_WATCH;
+		break;
+	case 'u':
+		if (verb_len == 7 && !memcmp(verb, "unwatch", 7))
+			cmd->verb = CMD_UNWATCH;
+		break;
+	case 'e':
+		if (verb_len == 4 && !memcmp(verb, "exit", 4))
+			cmd->verb = CMD_EXIT;
+		break;
+	}
+
+	if (cmd->verb == CMD_BUY || cmd->verb == CMD_SELL)
+	{
+		if ((p = parse_int(p, end, &cmd->stock_id)) == NULL || parse_int(p, end, &cmd->stock_num) == NULL
+			|| cmd->stock_num <= 0)
+			cmd->verb = CMD_INVALID;
+	}
+	else if (cmd->verb == CMD_BID || cmd->verb == CMD_ASK)
+	{
+		if ((p = parse_int(p, end, &cmd->stock_id)) == NULL || (p = parse_int(p, end, &cmd->price)) == NULL
+			|| parse_int(p, end, &cmd->stock_num) == NULL || cmd->stock_num <= 0)
+			cmd->verb = CMD_INVALID;
+	}
+	else if (cmd->verb == CMD_CANCEL)
+	{
+		if ((p = parse_int(p, end, &cmd->stock_id)) == NULL || parse_ll(p, end, &cmd->order_id) == NULL)
+			cmd->verb = CMD_INVALID;
+	}
+	else if (cmd->verb == CMD_BOOK)
+	{
+		if (parse_int(p, end, &cmd->stock_id) == NULL)
+			cmd->verb = CMD_INVALID;
+	}
+	else if (cmd->verb == CMD_ACCOUNT)
+	{
+		if (parse_int(p, end, &cmd->account_id) == NULL || cmd->account_id <= 0)
+			cmd->verb = CMD_INVALID;
+	}
+	else if (cmd->verb == CMD_DEPOSIT)
+	{
+		if (parse_ll(p, end, &cmd->amount) == NULL)
+			cmd->verb = CMD_INVALID;
+	}
+	else if (cmd->verb == CMD_BATCH)
+	{
+		if (parse_int(p, end, &cmd->count) == NULL || cmd->count < 1 || cmd->count > BATCH_MAX)
+			cmd->verb = CMD_INVALID;
+	}
+	else if (cmd->verb == CMD_MULTI)
+	{
+		if (parse_int(p, end, &cmd->count) == NULL || cmd->count < 1 || cmd->count > MULTI_MAX)
+			cmd->verb = CMD_INVALID;
+	}
+	else if (cmd->verb == CMD_SHOW)
+	{
+		const char* arg = skip_space(p, end);
+
+		if (end - arg >= 5 && !memcmp(arg, "since", 5) && (arg + 5 == end || arg[5] == ' ' || arg[5] == '\t'))
+		{
+			if ((p = parse_ll(arg + 5, end, &cmd->since)) != NULL && skip_space(p, end) == end)
+				cmd->verb = CMD_SINCE;
+			else
+				cmd->verb = CMD_INVALID;
+		}
+	}
+	else if (cmd->verb == CMD_WATCH)
+	{
+		const char* arg = skip_space(p, end);
+		const char* next;
+		int id;
+
+		cmd->args = p;
+		cmd->end = end;
+		cmd->count = 0;
+		if (end - arg >= 3 && !memcmp(arg, "all", 3) && skip_space(arg + 3, end) == end)
+			cmd->count = WATCH_ALL;
+		else
+		{
+			for (; (next = parse_int(p, end, &id)) != NULL; p = next)
+				cmd->count++;
+			if (cmd->count == 0 || skip_space(p, end) != end)   // Stopped before the end: not a number
+				cmd->verb = CMD_INVALID;
+		}
+	}
+}
+
+// Read with recv(flags) if flags is set, which needs a socket
+static ssize_t readline_inplace(rio_t* rp, char** line, int flags)
+{
+	char* nl;
+	ssize_t n;
+
+	while (1)
+	{
+		if (rp->rio_cnt > 0 && (nl = memchr(rp->rio_bufptr, '\n', rp->rio_cnt)) != NULL)
+		{
+			n = nl - rp->rio_bufptr + 1;
+			break;
+		}
+		if (rp->rio_cnt == RIO_BUFSIZE)
+		{
+			n = RIO_BUFSIZE;
+			break;
+		}
+
+		// Keep the partial line and read the rest behind it
+		if (rp->rio_cnt > 0)
+			memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+		else
+			rp->rio_cnt = 0;
+		rp->rio_bufptr = rp->rio_buf;
+		if (flags)
+			n = recv(rp->rio_fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt, flags);
+		else
+			n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+		{
+			if (rp->rio_cnt == 0)
+				return 0;
+			n = rp->rio_cnt;   // Last line without a newline
+			break;
+		}
+		rp->rio_cnt += n;
+	}
+
+	*line = rp->rio_bufptr;
+	rp->rio_bufptr += n;
+	rp->rio_cnt -= n;
+	return n;
+}
+
+// Like rio_readlineb, but instead of copying the line out, point *line at it
+// inside rp's buffer. The line stays valid until the next read from rp. A line
+// longer than the buffer is returned in RIO_BUFSIZE pieces. Returns the line
+// length including the newline, 0 on EOF and -1 on error.
+ssize_t rio_readline_inplace(rio_t* rp, char** line)
+{
+	return readline_inplace(rp, line, 0);
+}
+
+// rio_readline_inplace() for a socket that must not block: returns -1 with
+// errno EAGAIN once neither rp's buffer nor the socket has a whole line. A
+// partial line stays in the buffer for the next call.
+ssize_t rio_readline_nowait(rio_t* rp, char** line)
+{
+	return readline_inplace(rp, line, MSG_DONTWAIT);
+}
+
+// Whether rp's buffer holds a whole line, which the next read returns without
+// touching the socket
+int rio_has_line(rio_t* rp)
+{
+	return rp->rio_cnt == RIO_BUFSIZE || (rp->rio_cnt > 0 && memchr(rp->rio_bufptr, '\n', rp->rio_cnt) != NULL);
+}
@@ -0,0 +1,55 @@
+/*
+ * parse.h - single-pass parser for the text protocol
+ */
+#ifndef __PARSE_H__
+#define __PARSE_H__
+
+#include "csapp.h"
+#include "engine.h"    // BATCH_MAX and MULTI_MAX
+
+#define CMD_INVALID 0
+#define CMD_EMPTY   1    // Blank line
+#define CMD_SHOW    2
+#define CMD_BUY     3
+#define CMD_SELL    4
+#define CMD_EXIT    5
+#define CMD_BINARY  6    // Switch the connection to the binary protocol
+#define CMD_BATCH   7    // "batch <n>", followed by n buy/sell lines
+#define CMD_MULTI   8    // "multi <n>", followed by n buy/sell legs applied all or none
+#define CMD_WATCH   9    // "watch <id...>" or "watch all"
+#define CMD_UNWATCH 10   // Drop every subscription of the connection
+#define CMD_SINCE   11   // "show since <seq>": stocks changed after change number seq
+#define CMD_SHM     12   // Move the connection to a shared-memory ring pair, see shmring.h
+#define CMD_BID     13   // "bid <id> <price> <qty>": limit buy against the order book
+#define CMD_ASK     14   // "ask <id> <price> <qty>": limit sell against the order book
+#define CMD_CANCEL  15   // "cancel <id> <order_id>"
+#define CMD_BOOK    16   // "book <id>": best price levels of the order book
+#define CMD_ACCOUNT 17   // "account <account_id>": charge the connection's orders to it from now on
+#define CMD_DEPOSIT 18   // "deposit <amount>": add cash to the account, or take it out if negative
+#define CMD_BALANCE 19   // The account's cash and positions
+
+#define WATCH_ALL -1     // command_t.count of "watch all"
+
+typedef struct {
+	int verb;          // CMD_*
+	int tagged;        // The line started with "#<tag> ": the reply carries the tag and may overtake others
+	long long tag;
+	int stock_id;      // buy/sell/bid/ask/cancel/book
+	int stock_num;     // buy/sell/bid/ask
+	int price;         // bid/ask only: limit price
+	long long order_id;   // cancel only
+	int count;         // batch/multi: number of order lines that follow; watch: number of ids or WATCH_ALL
+	long long since;   // show since only: change number the client has seen
+	int account_id;    // account only
+	long long amount;  // deposit only
+	const char* args;  // watch only: the ids, read them with parse_int()
+	const char* end;   // watch only: end of the line
+} command_t;
+
+const char* parse_int(const char* p, const char* end, int* out);
+void parse_command(const char* line, int len, command_t* cmd);
+ssize_t rio_readline_inplace(rio_t* rp, char** line);
+ssize_t rio_readline_nowait(rio_t* rp, char** line);
+int rio_has_line(rio_t* rp);
+
+#endif /* __PARSE_H__ */
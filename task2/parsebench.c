@@ -0,0 +1,72 @@
+/*
+ * parsebench.c - cost of parsing one text command
+ *
+ * Compares the former path (zero the 8 KB line buffer, sscanf into an 8 KB
+ * verb buffer, strcmp chain) with parse_command() on the same mix of commands.
+ */
+#include "csapp.h"
+#include "parse.h"
+#include <time.h>
+
+#define ROUNDS 2000000
+
+char* commands[] = { "buy 3 5\n", "sell 12 7\n", "show\n", "buy 1024 10\n", "sell 7 1\n", "bogus 1 2\n" };
+#define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+volatile int sink;   // Keeps the results alive
+
+long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// The former per-command work of the task2 worker and execute_command()
+int parse_sscanf(char* line, char* command)
+{
+	char order[MAXLINE];
+	int stock_id = 0, stock_num = 0, i;
+
+	for (i = 0; i < MAXLINE; i++)
+		command[i] = '\0';
+	strcpy(command, line);
+	sscanf(command, "%s %d %d", order, &stock_id, &stock_num);
+	if (!strcmp(order, "show"))
+		return CMD_SHOW;
+	else if (!strcmp(order, "buy"))
+		return CMD_BUY + stock_id + stock_num;
+	else if (!strcmp(order, "sell"))
+		return CMD_SELL + stock_id + stock_num;
+	return CMD_INVALID;
+}
+
+int main(int argc, char** argv)
+{
+	static char command[MAXLINE];
+	int lens[NCOMMANDS];
+	command_t cmd;
+	long i, start, before, after;
+	int j;
+
+	for (i = 0; i < NCOMMANDS; i++)
+		lens[i] = strlen(commands[i]);
+
+	start = now_ns();
+	for (i = 0, j = 0; i < ROUNDS; i++, j = j + 1 == NCOMMANDS ? 0 : j + 1)
+		sink = parse_sscanf(commands[j], command);
+	before = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0, j = 0; i < ROUNDS; i++, j = j + 1 == NCOMMANDS ? 0 : j + 1)
+	{
+		parse_command(commands[j], lens[j], &cmd);
+		sink = cmd.verb + cmd.stock_id + cmd.stock_num;
+	}
+	after = now_ns() - start;
+
+	printf("sscanf + strcmp: %6.1f ns/command\n", (double)before / ROUNDS);
+	printf("parse_command:   %6.1f ns/command\n", (double)after / ROUNDS);
+	return 0;
+}
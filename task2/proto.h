@@ -0,0 +1,57 @@
+/*
+ * proto.h - binary wire protocol shared by the server and binary clients
+ *
+ * A connection starts in the text protocol. A client that sends the line
+ * "binary\n" and reads back "binary ok\n" switches the connection to
+ * length-prefixed frames: a bin_hdr_t followed by hdr.len payload bytes.
+ * Integers are little-endian.
+ *
+ *   request  BIN_BUY / BIN_SELL   hdr + bin_order_t        (12 bytes)
+ *   response BIN_BUY / BIN_SELL   hdr, status = RESULT_*   (4 bytes)
+ *   request  BIN_SHOW             hdr                      (4 bytes)
+ *   response BIN_SHOW             hdr + bin_stock_t[]; every frame but the
+ *                                 last has status RESULT_MORE
+ */
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include <stdint.h>
+#include <endian.h>
+
+#define BIN_HELLO    "binary\n"
+#define BIN_HELLO_OK "binary ok\n"
+
+#define BIN_BUY  1
+#define BIN_SELL 2
+#define BIN_SHOW 3
+
+// Outcome of an order, shared by the text and binary paths
+#define RESULT_OK          0
+#define RESULT_NO_STOCK    1    // stock_id not exists
+#define RESULT_NOT_ENOUGH  2    // Not enough left stocks
+#define RESULT_INVALID     3    // Unknown or malformed command
+#define RESULT_MORE        4    // Show frame with more frames to follow
+#define RESULT_NO_CASH     5    // Not enough cash in the account
+#define RESULT_NO_POSITION 6    // Not enough of the stock in the account
+#define RESULT_BUSY        7    // Refused by the server's rate limits or load shedding, not run
+
+#define BIN_SHOW_MAX 5000      // bin_stock_t per show frame, keeps len within 16 bits
+
+typedef struct {
+	uint16_t len;       // Payload bytes after this header
+	uint8_t type;       // BIN_BUY, BIN_SELL or BIN_SHOW
+	uint8_t status;     // RESULT_* in responses, 0 in requests
+} bin_hdr_t;
+
+typedef struct {
+	int32_t stock_id;
+	int32_t stock_num;
+} bin_order_t;
+
+typedef struct {
+	int32_t stock_id;
+	int32_t left_stock;
+	int32_t stock_price;
+} bin_stock_t;
+
+#endif /* __PROTO_H__ */
@@ -0,0 +1,359 @@
+/*
+ * reactor.c - select, epoll and io_uring event loops, see reactor.h
+ *
+ * An epoll reactor is given new connections with epoll_ctl by the acceptor
+ * directly. A select or io_uring reactor owns its interest set, so new
+ * connections are queued for it and announced on an eventfd that it watches
+ * along with its connections.
+ *
+ * io_uring is driven through the raw system calls, without liburing: every
+ * connection has one one-shot IORING_OP_POLL_ADD in flight, armed again after
+ * ready(). Reads and writes stay ordinary system calls, so every model runs
+ * the same command path and only the waiting differs.
+ */
+#include "reactor.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+
+#define EVENTS       256     // epoll events taken at once
+#define RING_ENTRIES 1024    // io_uring submission queue entries
+
+typedef struct entry {
+	int fd;
+	void* conn;
+	struct entry* next;      // In the reactor's queue until it watches fd
+} entry_t;
+
+typedef struct {
+	int fd;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned queued;         // Submission entries written but not yet submitted
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+} ring_t;
+
+typedef struct {
+	int model;
+	int epfd;                // MODEL_EPOLL and MODEL_MULTIREACTOR
+	int wake;                // eventfd announcing queued connections, MODEL_SELECT and MODEL_URING
+	pthread_mutex_t mutex;   // Protects queued
+	entry_t* queued;
+	ring_t ring;             // MODEL_URING
+} reactor_t;
+
+static reactor_t* reactors;
+static int nreactors = 0;
+static unsigned int next_reactor = 0;
+static reactor_ready_t* ready_fn;
+static reactor_done_t* done_fn;
+static __thread int backlog = 0;    // Connections of the reactor's round still to be served after the current one
+static int backlog_max = 0;         // Most backlog any started reactor can report, see reactor_backlog_max()
+
+// Pass e's connection to done() once the reactor no longer watches it
+static void drop(entry_t* e)
+{
+	void* conn = e->conn;
+
+	Free(e);
+	done_fn(conn);
+}
+
+// Take the connections queued for r since the last call
+static entry_t* take_queued(reactor_t* r)
+{
+	uint64_t n;
+	entry_t* e;
+
+	if (read(r->wake, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		unix_error("eventfd read error");
+	pthread_mutex_lock(&r->mutex);
+	e = r->queued;
+	r->queued = NULL;
+	pthread_mutex_unlock(&r->mutex);
+	return e;
+}
+
+static void* select_loop(void* vargp)
+{
+	reactor_t* r = (reactor_t*)vargp;
+	entry_t** entries = Calloc(FD_SETSIZE, sizeof(entry_t*));
+	entry_t* e;
+	entry_t* next;
+	fd_set watch_set, pending_set;
+	int fd, fd_max = r->wake, n;
+
+	Pthread_detach(pthread_self());
+	FD_ZERO(&watch_set);
+	FD_SET(r->wake, &watch_set);
+	while (1)
+	{
+		pending_set = watch_set;
+		if ((n = select(fd_max + 1, &pending_set, NULL, NULL, NULL)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			unix_error("select error");
+		}
+		backlog = n - (FD_ISSET(r->wake, &pending_set) ? 1 : 0);
+		for (fd = 0; fd <= fd_max; fd++)
+		{
+			if ((e = entries[fd]) == NULL || !FD_ISSET(fd, &pending_set))
+				continue;
+			backlog--;
+			if (ready_fn(e->conn) == REACTOR_DROP)
+			{
+				FD_CLR(fd, &watch_set);
+				entries[fd] = NULL;
+				drop(e);
+			}
+		}
+		// After the round: a new connection may reuse the number of one just dropped
+		if (FD_ISSET(r->wake, &pending_set))
+			for (e = take_queued(r); e; e = next)
+			{
+				next = e->next;
+				entries[e->fd] = e;
+				FD_SET(e->fd, &watch_set);
+				if (e->fd > fd_max)
+					fd_max = e->fd;
+			}
+	}
+	return NULL;
+}
+
+static void* epoll_loop(void* vargp)
+{
+	reactor_t* r = (reactor_t*)vargp;
+	struct epoll_event events[EVENTS];
+	int i, n;
+
+	Pthread_detach(pthread_self());
+	while (1)
+	{
+		if ((n = epoll_wait(r->epfd, events, EVENTS, -1)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			unix_error("epoll_wait error");
+		}
+		for (i = 0; i < n; i++)
+		{
+			entry_t* e = (entry_t*)events[i].data.ptr;
+
+			backlog = n - i - 1;
+			if (ready_fn(e->conn) == REACTOR_DROP)
+			{
+				epoll_ctl(r->epfd, EPOLL_CTL_DEL, e->fd, NULL);   // Before done() closes it
+				drop(e);
+			}
+		}
+	}
+	return NULL;
+}
+
+// Map the rings of a new io_uring instance. Returns -1 if the kernel has none.
+static int ring_setup(ring_t* ring)
+{
+	struct io_uring_params p;
+	size_t sq_len, cq_len;
+	char* sq;
+	char* cq;
+
+	memset(&p, 0, sizeof(p));
+	if ((ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p)) < 0)
+		return -1;
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq :
+		mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED)
+	{
+		close(ring->fd);
+		return -1;
+	}
+	ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+	ring->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->queued = 0;
+	ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+// Submit what is queued and, with wait, block until a completion is there
+static void ring_enter(ring_t* ring, int wait)
+{
+	int n;
+
+	while ((n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0)
+	{
+		if (errno != EINTR)
+			unix_error("io_uring_enter error");
+	}
+	ring->queued -= n;
+}
+
+// Queue a one-shot poll for input on fd; e comes back as its user_data
+static void ring_poll(ring_t* ring, int fd, entry_t* e)
+{
+	unsigned tail = *ring->sq_tail, idx;
+	struct io_uring_sqe* sqe;
+
+	while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)   // Full
+		ring_enter(ring, 0);
+	idx = tail & ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = (unsigned long)e;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+}
+
+static void* uring_loop(void* vargp)
+{
+	reactor_t* r = (reactor_t*)vargp;
+	ring_t* ring = &r->ring;
+	entry_t* e;
+	entry_t* next;
+	unsigned head;
+
+	Pthread_detach(pthread_self());
+	ring_poll(ring, r->wake, NULL);
+	while (1)
+	{
+		ring_enter(ring, 1);
+		for (head = *ring->cq_head; head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE); )
+		{
+			e = (entry_t*)(unsigned long)ring->cqes[head & ring->cq_mask].user_data;
+			__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+			if (e == NULL)   // The eventfd: arm a poll for every queued connection
+			{
+				for (e = take_queued(r); e; e = next)
+				{
+					next = e->next;
+					ring_poll(ring, e->fd, e);
+				}
+				ring_poll(ring, r->wake, NULL);
+			}
+			else
+			{
+				backlog = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - head;
+				if (ready_fn(e->conn) == REACTOR_KEEP)
+					ring_poll(ring, e->fd, e);
+				else
+					drop(e);   // No poll is armed on it any more
+			}
+		}
+	}
+	return NULL;
+}
+
+// Start nreactors reactor threads of model. If the kernel has no io_uring,
+// MODEL_URING falls back to epoll.
+void reactor_start(int model, int n, reactor_ready_t* ready, reactor_done_t* done)
+{
+	pthread_t tid;
+	int i, max;
+
+	ready_fn = ready;
+	done_fn = done;
+	reactors = Calloc(n, sizeof(reactor_t));
+	nreactors = n;
+	for (i = 0; i < n; i++)
+	{
+		reactor_t* r = &reactors[i];
+
+		r->model = model;
+		pthread_mutex_init(&r->mutex, NULL);
+		if (model == MODEL_URING && ring_setup(&r->ring) < 0)
+		{
+			fprintf(stderr, "io_uring unavailable (%s), using epoll\n", strerror(errno));
+			r->model = MODEL_EPOLL;
+		}
+		if (r->model == MODEL_SELECT || r->model == MODEL_URING)
+		{
+			if ((r->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+				unix_error("eventfd error");
+		}
+		else if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			unix_error("epoll_create1 error");
+		max = r->model == MODEL_SELECT ? FD_SETSIZE - 5 :   // Less stdin, stdout, stderr, wake and the one served
+			r->model == MODEL_URING ? (int)r->ring.cq_mask :   // A full completion queue less the one served
+			EVENTS - 1;                                        // One epoll_wait batch less the one served
+		if (i == 0 || max < backlog_max)
+			backlog_max = max;
+		Pthread_create(&tid, NULL, r->model == MODEL_SELECT ? select_loop : r->model == MODEL_URING ? uring_loop : epoll_loop, r);
+	}
+}
+
+// Watch fd on the next reactor in turn. Returns -1 if that reactor cannot
+// take it, which only happens to select with a descriptor past FD_SETSIZE.
+int reactor_add(int fd, void* conn)
+{
+	reactor_t* r = &reactors[__atomic_fetch_add(&next_reactor, 1, __ATOMIC_RELAXED) % nreactors];
+	uint64_t one = 1;
+	entry_t* e;
+
+	if (r->model == MODEL_SELECT && fd >= FD_SETSIZE)
+		return -1;
+	e = Malloc(sizeof(entry_t));
+	e->fd = fd;
+	e->conn = conn;
+	if (r->model == MODEL_EPOLL || r->model == MODEL_MULTIREACTOR)
+	{
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = e;
+		if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			unix_error("epoll_ctl error");
+		return 0;
+	}
+	pthread_mutex_lock(&r->mutex);
+	e->next = r->queued;
+	r->queued = e;
+	pthread_mutex_unlock(&r->mutex);
+	if (write(r->wake, &one, sizeof(one)) < 0)
+		unix_error("eventfd write error");
+	return 0;
+}
+
+// Connections the calling reactor found ready in this round and has not served
+// yet, 0 off a reactor thread
+int reactor_backlog()
+{
+	return backlog;
+}
+
+// The largest reactor_backlog() the started reactors can report: a round is
+// one select() over at most FD_SETSIZE descriptors, one batch of EVENTS epoll
+// events or one pass over the io_uring completion queue, so a threshold above
+// this never trips
+int reactor_backlog_max()
+{
+	return backlog_max;
+}
@@ -0,0 +1,42 @@
+/*
+ * reactor.h - event loops that serve many connections from one thread each
+ *
+ * Every model but MODEL_THREADPOOL hands its connections to reactors. A
+ * reactor waits until a connection has input and calls ready() for it on the
+ * reactor's own thread; ready() must not wait for the client. Once ready()
+ * returns REACTOR_DROP the reactor stops watching the descriptor and calls
+ * done(), which closes it or hands it to another thread.
+ *
+ * While ready() runs, reactor_backlog() tells it how many more connections
+ * the reactor found ready in the same round, so it can shed load when the
+ * loop falls behind. A round is bounded by the model, so reactor_backlog()
+ * never exceeds reactor_backlog_max(): 255 for epoll.
+ *
+ * Only input is waited for here. Output is not queued and there is no
+ * interest in writability: ready() writes its replies with blocking calls,
+ * so a client that stops reading stalls every connection of its reactor once
+ * its socket buffer is full.
+ */
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include "csapp.h"
+
+#define MODEL_THREADPOOL   0   // Prethreaded workers, one connection each at a time, fed through sbuf
+#define MODEL_SELECT       1   // One select() loop
+#define MODEL_EPOLL        2   // One epoll loop
+#define MODEL_MULTIREACTOR 3   // One epoll loop per reactor thread, connections spread round-robin
+#define MODEL_URING        4   // One loop waiting on io_uring poll completions
+
+#define REACTOR_KEEP 0
+#define REACTOR_DROP 1
+
+typedef int reactor_ready_t(void* conn);
+typedef void reactor_done_t(void* conn);
+
+void reactor_start(int model, int nreactors, reactor_ready_t* ready, reactor_done_t* done);
+int reactor_add(int fd, void* conn);
+int reactor_backlog();
+int reactor_backlog_max();
+
+#endif /* __REACTOR_H__ */
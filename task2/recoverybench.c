@@ -0,0 +1,75 @@
+/*
+ * recoverybench.c - recovery time against journal length
+ *
+ * Writes synthetic journals of increasing length into a scratch directory and
+ * times journal_replay() with one thread and with every online CPU, so that
+ * checkpoint intervals can be sized from the journal length they allow.
+ */
+#include "csapp.h"
+#include "journal.h"
+
+#define STOCK_NUM 10000    // Instruments touched by the synthetic orders
+
+int* left;                 // Store stand-in: left_stock indexed by stock_id
+
+void apply(int stock_id, int left_stock)
+{
+	left[stock_id] = left_stock;
+}
+
+// Write n random orders into a single segment
+void write_journal(long n)
+{
+	journal_rec_t rec;
+	long i;
+	int fd = Open("stock.journal.0", O_WRONLY | O_CREAT | O_TRUNC, DEF_MODE);
+
+	for (i = 0; i < n; i++)
+	{
+		rec.seq = i + 1;
+		rec.stock_id = rand() % STOCK_NUM;
+		rec.op = rand() % 2 ? JOURNAL_BUY : JOURNAL_SELL;
+		rec.stock_num = rand() % 10 + 1;
+		rec.left_stock = rand() % 1000;
+		Rio_writen(fd, &rec, sizeof(rec));
+	}
+	Close(fd);
+}
+
+long replay_us(int nthreads)
+{
+	struct timeval start, end;
+
+	gettimeofday(&start, NULL);
+	journal_replay(apply, nthreads, 0);
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+}
+
+int main(int argc, char** argv)
+{
+	char dir[] = "/tmp/recoverybench.XXXXXX";
+	long lengths[] = { 10000, 100000, 1000000, 4000000 };
+	int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+	if (mkdtemp(dir) == NULL || chdir(dir) < 0)
+		unix_error("scratch directory error");
+	left = Calloc(STOCK_NUM, sizeof(int));
+
+	printf("%12s %12s %16s %16s\n", "orders", "MB", "1 thread (ms)", "threads (ms)");
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+	{
+		write_journal(lengths[i]);
+		long one = replay_us(1);
+		long all = replay_us(ncpu);
+		printf("%12ld %12.1f %16.2f %13.2f/%d\n", lengths[i], lengths[i] * sizeof(journal_rec_t) / 1e6,
+			one / 1000.0, all / 1000.0, ncpu);
+	}
+
+	unlink("stock.journal.0");
+	if (chdir("/") == 0)
+		rmdir(dir);
+	Free(left);
+	return 0;
+}
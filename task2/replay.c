@@ -0,0 +1,465 @@
+/*
+ * replay.c - drive a server with a command log recorded by --record
+ *
+ * usage: replay <log> <host> <port> [--speed=N|max] [--serial]
+ *        replay <log> --local
+ *
+ * Every connection of the log gets its own connection to the server, and its
+ * lines are sent at the recorded times scaled by --speed (1 by default, max
+ * for no waiting). Replies are read as they come and not checked.
+ *
+ * --serial instead sends one line at a time in log order and waits for its
+ * reply before the next, so the server sees exactly the recorded interleaving
+ * and the final state depends on nothing but the log and the build.
+ *
+ * At the end a fresh connection asks for show, and the replay reports
+ * throughput and an FNV-1a checksum of the final state to compare across
+ * builds.
+ *
+ * --local applies the log in log order straight to the engine library, with
+ * stock.txt of the working directory as the starting state and no sockets,
+ * threads or disk writes in between. Its checksum matches that of --serial
+ * against a server started on the same stock.txt.
+ */
+#include "csapp.h"
+#include "cmdlog.h"
+#include "parse.h"
+#include "engine.h"
+#include <poll.h>
+#include <time.h>
+#include <netinet/tcp.h>
+
+#define CONN_BUF 65536    // Bytes read from a socket at once
+
+typedef struct {
+	int fd;               // -1 until the first line, and again once closed
+	int open;             // Sending side still open
+	int lines_left;       // Lines of a batch or multi still to come before its reply is due
+	char in[8];           // Start of the reply line being read, enough to tell an update
+	int in_len;
+	long replies;         // Reply lines seen, updates not counted
+} conn_t;
+
+typedef struct {
+	int verb;             // CMD_BATCH or CMD_MULTI whose lines are being collected
+	int want;             // Lines it has, 0 when none is open
+	int n;                // Lines collected so far
+	int account_id;       // Picked by an account line, ACCOUNT_NONE before
+	engine_order_t orders[BATCH_MAX];
+} local_conn_t;
+
+char* host;
+char* port;
+conn_t** conns = NULL;    // Indexed by connection id
+int nconns = 0;
+int total = 0;            // Connections in the log
+int live = 0;             // Connections not yet at end of file
+long replies = 0;
+long reply_bytes = 0;
+
+long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+conn_t* get_conn(unsigned int id)
+{
+	if (id >= nconns)
+	{
+		int n = id + 1 > nconns * 2 ? id + 1 : nconns * 2;
+
+		conns = Realloc(conns, sizeof(conn_t*) * n);
+		memset(conns + nconns, 0, sizeof(conn_t*) * (n - nconns));
+		nconns = n;
+	}
+	if (conns[id] == NULL)
+	{
+		int one = 1;
+
+		conns[id] = Calloc(1, sizeof(conn_t));
+		conns[id]->fd = Open_clientfd(host, port);
+		setsockopt(conns[id]->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));   // Lines of a batch go out one by one
+		conns[id]->open = 1;
+		total++;
+		live++;
+	}
+	return conns[id];
+}
+
+// Take what c's socket has without blocking, and count its reply lines
+void drain(conn_t* c)
+{
+	char buf[CONN_BUF];
+	ssize_t n;
+	int i, start;
+
+	while (c->fd >= 0 && (n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT)) != 0)
+	{
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+			n = 0;   // A reset ends the connection like end of file
+		}
+		if (n == 0)
+			break;
+		reply_bytes += n;
+		for (i = 0, start = 0; i < n; i++)
+		{
+			if (buf[i] != '\n')
+				continue;
+			if (c->in_len < 8)
+			{
+				int k = i - start < 8 - c->in_len ? i - start : 8 - c->in_len;
+
+				memcpy(c->in + c->in_len, buf + start, k);
+				c->in_len += k;
+			}
+			if (c->in_len < 8 || memcmp(c->in, "[update]", 8))
+			{
+				c->replies++;
+				replies++;
+			}
+			c->in_len = 0;
+			start = i + 1;
+		}
+		if (c->in_len < 8 && start < n)
+		{
+			int k = n - start < 8 - c->in_len ? n - start : 8 - c->in_len;
+
+			memcpy(c->in + c->in_len, buf + start, k);
+			c->in_len += k;
+		}
+	}
+	if (c->fd >= 0)
+	{
+		Close(c->fd);
+		c->fd = -1;
+		live--;
+	}
+}
+
+// Wait up to timeout_ms for any connection to have something, and drain it.
+// With want, also return once want can be written to.
+void poll_all(int timeout_ms, conn_t* want)
+{
+	struct pollfd* pfds = Malloc(sizeof(struct pollfd) * (nconns + 1));
+	conn_t** who = Malloc(sizeof(conn_t*) * (nconns + 1));
+	int i, n = 0;
+
+	for (i = 0; i < nconns; i++)
+		if (conns[i] && conns[i]->fd >= 0)
+		{
+			pfds[n].fd = conns[i]->fd;
+			pfds[n].events = POLLIN | (conns[i] == want ? POLLOUT : 0);
+			who[n++] = conns[i];
+		}
+	if (poll(pfds, n, timeout_ms) > 0)
+		for (i = 0; i < n; i++)
+			if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				drain(who[i]);
+	Free(pfds);
+	Free(who);
+}
+
+// Send len bytes on c, reading replies meanwhile so neither side can stall the other
+void send_line(conn_t* c, const char* buf, int len)
+{
+	ssize_t n;
+
+	while (len > 0 && c->fd >= 0)
+	{
+		if ((n = send(c->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return;   // The server closed it, after exit for one
+			poll_all(100, c);
+			continue;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+// Whether the line just sent on c completes a command that gets a reply
+int reply_due(conn_t* c, const char* line, int len)
+{
+	command_t cmd;
+
+	if (c->lines_left > 0)
+		return --c->lines_left == 0;
+	parse_command(line, len, &cmd);
+	if (cmd.verb == CMD_BATCH || cmd.verb == CMD_MULTI)
+	{
+		c->lines_left = cmd.count;
+		return 0;
+	}
+	return 1;
+}
+
+// FNV-1a checksum of a show reply; n is set to the instruments in it
+unsigned long long checksum(const char* line, int len, int* n)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	int i;
+
+	*n = 0;
+	for (i = 0; i < len; i++)
+	{
+		h = (h ^ (unsigned char)line[i]) * 1099511628211ULL;
+		*n += line[i] == '\t';   // Every instrument ends in one
+	}
+	return h;
+}
+
+// Checksum of the show reply of a fresh connection
+unsigned long long final_state(int* n)
+{
+	unsigned long long h;
+	rio_t rio;
+	char* line = Malloc(1 << 24);
+	int fd = Open_clientfd(host, port), len;
+
+	Rio_readinitb(&rio, fd);
+	Rio_writen(fd, "show\n", strlen("show\n"));
+	len = Rio_readlineb(&rio, line, 1 << 24);
+	h = checksum(line, len, n);
+	Close(fd);
+	Free(line);
+	return h;
+}
+
+void skip_fill(void* arg, long long maker_id, int price, int qty)
+{
+}
+
+// Apply one line of c to the engine as the server would. Replies that read
+// the store are rendered into out, so their cost is counted, and dropped.
+void local_line(local_conn_t* c, const char* line, int len, char* out)
+{
+	command_t cmd;
+	engine_book_t book;
+	long long id, cash;
+	int failed, resting, qty;
+
+	parse_command(line, len, &cmd);
+	if (c->want > 0)   // A line of the open batch or multi
+	{
+		engine_order_t* o = &c->orders[c->n++];
+
+		o->side = cmd.verb == CMD_BUY ? ORDER_BUY : cmd.verb == CMD_SELL ? ORDER_SELL : 0;
+		o->stock_id = cmd.stock_id;
+		o->stock_num = cmd.stock_num;
+		if (c->n < c->want)
+			return;
+		if (c->verb == CMD_BATCH)
+			engine_batch(c->account_id, c->orders, c->n);
+		else
+			engine_multi(c->account_id, c->orders, c->n, &failed);
+		c->want = 0;
+		return;
+	}
+	switch (cmd.verb)
+	{
+	case CMD_BUY:
+		engine_buy(c->account_id, cmd.stock_id, cmd.stock_num);
+		break;
+	case CMD_SELL:
+		engine_sell(c->account_id, cmd.stock_id, cmd.stock_num);
+		break;
+	case CMD_ACCOUNT:
+		engine_account(cmd.account_id);
+		c->account_id = cmd.account_id;
+		break;
+	case CMD_DEPOSIT:
+		if (c->account_id != ACCOUNT_NONE)
+			engine_deposit(c->account_id, cmd.amount, &cash);
+		break;
+	case CMD_BATCH:
+	case CMD_MULTI:
+		c->verb = cmd.verb;
+		c->want = cmd.count;
+		c->n = 0;
+		break;
+	case CMD_SHOW:
+		engine_show(out);
+		break;
+	case CMD_SINCE:
+		engine_since(cmd.since, out);
+		break;
+	case CMD_BID:
+	case CMD_ASK:
+		engine_limit(cmd.stock_id, cmd.verb == CMD_BID ? SIDE_BID : SIDE_ASK, cmd.price, cmd.stock_num, &id, &resting, skip_fill, NULL);
+		break;
+	case CMD_CANCEL:
+		engine_cancel(cmd.stock_id, cmd.order_id, &qty);
+		break;
+	case CMD_BOOK:
+		engine_book(cmd.stock_id, &book);
+		break;
+	}   // Anything else leaves the store as it is
+}
+
+// Replay the size bytes of log in log order against the engine in this process
+void replay_local(char* log, long size)
+{
+	engine_config_t config = { PERSIST_REWRITE, DURABILITY_MEMORY, ENGINE_LOCKED, 1, NULL };
+	local_conn_t** lconns = NULL;
+	long off, sent = 0, start, elapsed;
+	char* out;
+	int instruments, len;
+	unsigned long long sum;
+
+	engine_open(&config);
+	out = Malloc(engine_show_max());
+	start = now_ns();
+	for (off = strlen(CMDLOG_MAGIC); off + sizeof(cmdlog_rec_t) <= size; )
+	{
+		cmdlog_rec_t rec;
+		unsigned int id;
+
+		memcpy(&rec, log + off, sizeof(rec));
+		len = le32toh(rec.len);
+		if (off + sizeof(rec) + len > size)
+			break;
+		id = le32toh(rec.conn);
+		if (id >= nconns)
+		{
+			int n = id + 1 > nconns * 2 ? id + 1 : nconns * 2;
+
+			lconns = Realloc(lconns, sizeof(local_conn_t*) * n);
+			memset(lconns + nconns, 0, sizeof(local_conn_t*) * (n - nconns));
+			nconns = n;
+		}
+		if (lconns[id] == NULL)
+		{
+			lconns[id] = Calloc(1, sizeof(local_conn_t));
+			total++;
+		}
+		if (len > 0)
+		{
+			local_line(lconns[id], log + off + sizeof(rec), len, out);
+			sent++;
+		}
+		off += sizeof(rec) + len;
+	}
+	elapsed = now_ns() - start;
+
+	sum = checksum(out, engine_show(out), &instruments);
+	printf("%ld commands on %d connections in %.3f s: %.0f commands/s, in process\n",
+		sent, total, elapsed / 1e9, sent * 1e9 / elapsed);
+	printf("final state: %d instruments, checksum %016llx\n", instruments, sum);
+	engine_close();
+}
+
+int main(int argc, char** argv)
+{
+	double speed = 1;
+	int i, serial = 0, fd, instruments;
+	long size, off, sent = 0, start, elapsed;
+	char* log;
+	unsigned long long sum;
+
+	if (argc < 4 && (argc != 3 || strcmp(argv[2], "--local")))
+	{
+		fprintf(stderr, "usage: %s <log> <host> <port> [--speed=N|max] [--serial]\n"
+			"       %s <log> --local\n", argv[0], argv[0]);
+		exit(1);
+	}
+	host = argv[2];
+	port = argv[3];
+	for (i = 4; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--speed=max"))
+			speed = 0;
+		else if (!strncmp(argv[i], "--speed=", 8) && atof(argv[i] + 8) > 0)
+			speed = atof(argv[i] + 8);
+		else if (!strcmp(argv[i], "--serial"))
+			serial = 1;
+		else
+		{
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			exit(1);
+		}
+	}
+
+	fd = Open(argv[1], O_RDONLY, 0);
+	size = lseek(fd, 0, SEEK_END);
+	log = Malloc(size > 0 ? size : 1);
+	if (pread(fd, log, size, 0) != size || size < strlen(CMDLOG_MAGIC) || memcmp(log, CMDLOG_MAGIC, strlen(CMDLOG_MAGIC)))
+	{
+		fprintf(stderr, "%s: not a command log\n", argv[1]);
+		exit(1);
+	}
+	Close(fd);
+
+	if (argc == 3)
+	{
+		replay_local(log, size);
+		return 0;
+	}
+	start = now_ns();
+	for (off = strlen(CMDLOG_MAGIC); off + sizeof(cmdlog_rec_t) <= size; )
+	{
+		cmdlog_rec_t rec;
+		conn_t* c;
+		char* line;
+		int len;
+
+		memcpy(&rec, log + off, sizeof(rec));
+		len = le32toh(rec.len);
+		line = log + off + sizeof(rec);
+		if (off + sizeof(rec) + len > size)
+			break;   // Torn last record: the server was killed while writing it
+		off += sizeof(rec) + len;
+
+		if (speed > 0)   // Wait for the line's time, reading replies meanwhile
+		{
+			long due = start + (long)(le64toh(rec.ns) / speed);
+			long wait;
+
+			while ((wait = due - now_ns()) > 0)
+				poll_all(wait > 1000000 ? wait / 1000000 : 0, NULL);
+		}
+
+		c = get_conn(le32toh(rec.conn));
+		if (len == 0)
+		{
+			if (c->open && c->fd >= 0)
+				shutdown(c->fd, SHUT_WR);
+			c->open = 0;
+			continue;
+		}
+		if (!c->open)
+			continue;
+		send_line(c, line, len);
+		if (line[len - 1] != '\n')
+			send_line(c, "\n", 1);
+		sent++;
+		if (serial && reply_due(c, line, len))
+		{
+			long want = c->replies + 1;
+
+			while (c->replies < want && c->fd >= 0)
+				poll_all(100, NULL);
+		}
+	}
+	for (i = 0; i < nconns; i++)   // Connections the log left open end here
+		if (conns[i] && conns[i]->open && conns[i]->fd >= 0)
+		{
+			shutdown(conns[i]->fd, SHUT_WR);
+			conns[i]->open = 0;
+		}
+	while (live > 0)
+		poll_all(100, NULL);
+	elapsed = now_ns() - start;
+
+	sum = final_state(&instruments);
+	printf("%ld commands on %d connections in %.3f s: %.0f commands/s, %ld replies, %ld reply bytes\n",
+		sent, total, elapsed / 1e9, sent * 1e9 / elapsed, replies, reply_bytes);
+	printf("final state: %d instruments, checksum %016llx\n", instruments, sum);
+	return 0;
+}
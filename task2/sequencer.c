@@ -0,0 +1,219 @@
+/*
+ * sequencer.c - one single-writer sequencer thread per shard, fed by a ring
+ *
+ * Publishing is the disruptor's multi-producer claim: a worker takes the next
+ * sequence number with one fetch-and-add, fills the slot it maps to and then
+ * stores the sequence number into the slot, which is what makes the request
+ * visible. The sequencer consumes strictly in sequence order, so the order in
+ * which requests were claimed is the order in which they are applied. Either
+ * side sleeps in a futex only after spinning has not helped, and the other
+ * side only makes the wake call when it sees a sleeper.
+ *
+ * In a netting window the sequencer keeps the requests it applied in a held
+ * list. It flushes and completes them once the window has passed, which it
+ * checks after each request and, when the ring runs dry, by sleeping no
+ * longer than the window has left.
+ */
+#include "sequencer.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <time.h>
+
+#define SPIN 2000             // Polls before sleeping, with a CPU to spare
+#define SEQ_PARK -1           // Request op that parks the sequencer, see seq_park()
+
+typedef struct {
+	unsigned int seq;         // Sequence number of the request in the slot plus one, once published
+	seq_req_t* req;
+} seq_slot_t;
+
+typedef struct {
+	unsigned int claim;       // Next sequence number to hand out
+	char pad0[60];
+	unsigned int next;        // Next sequence number to apply; the slots of those before it are free
+	unsigned int sleeping;    // The sequencer is asleep on the slot of next
+	unsigned int hold;        // Parked: set by the sequencer, cleared by seq_unpark()
+	char pad1[52];
+	seq_slot_t slots[SEQ_RING];
+} shard_t;
+
+static shard_t* shards;
+static seq_apply_t* apply_fn;
+static seq_flush_t* flush_fn;
+static long net_ns = 0;       // Netting window, 0 completes every request as soon as it is applied
+static int spin = 0;
+
+// timeout is relative, NULL to wait for as long as it takes
+static int futex(unsigned int* addr, int op, unsigned int val, struct timespec* timeout)
+{
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+// Hand r back to its submitter. r may be gone as soon as done is stored; a
+// wake on its old address is at worst a spurious wakeup for someone else.
+static void complete(seq_req_t* r)
+{
+	if (__atomic_exchange_n(&r->done, 1, __ATOMIC_SEQ_CST) == 2)
+		futex(&r->done, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+}
+
+// Flush the requests held in the netting window and hand them back
+static void release(shard_t* sh, seq_req_t** held, int* nheld)
+{
+	int i;
+
+	flush_fn(sh - shards, held, *nheld);
+	for (i = 0; i < *nheld; i++)
+		complete(held[i]);
+	*nheld = 0;
+}
+
+static void* sequencer(void* vargp)
+{
+	shard_t* sh = (shard_t*)vargp;
+	unsigned int next = 0, seen;
+	seq_slot_t* slot;
+	seq_req_t* r;
+	seq_req_t** held = NULL;   // Applied in the netting window, not yet completed
+	int i, nheld = 0;
+	long deadline = 0, left;
+	struct timespec ts;
+
+	Pthread_detach(pthread_self());
+	if (net_ns > 0)
+		held = Malloc(sizeof(seq_req_t*) * SEQ_RING);
+	while (1)
+	{
+		slot = &sh->slots[next % SEQ_RING];
+		for (i = 0; (seen = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)) != next + 1 && i < spin; i++)
+			cpu_relax();
+		if (seen != next + 1)
+		{
+			if (nheld > 0 && (left = deadline - now_ns()) <= 0)
+			{
+				release(sh, held, &nheld);
+				continue;
+			}
+			ts.tv_sec = nheld > 0 ? left / 1000000000L : 0;
+			ts.tv_nsec = nheld > 0 ? left % 1000000000L : 0;
+			__atomic_store_n(&sh->sleeping, 1, __ATOMIC_SEQ_CST);
+			if ((seen = __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST)) != next + 1)
+				futex(&slot->seq, FUTEX_WAIT_PRIVATE, seen, nheld > 0 ? &ts : NULL);
+			__atomic_store_n(&sh->sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		r = slot->req;
+		__atomic_store_n(&sh->next, ++next, __ATOMIC_RELEASE);   // The slot may be claimed again
+		if (r->op == SEQ_PARK)
+		{
+			if (nheld > 0)   // Whoever parks us sees the window's orders applied
+				release(sh, held, &nheld);
+			__atomic_store_n(&sh->hold, 1, __ATOMIC_SEQ_CST);
+			complete(r);
+			while (__atomic_load_n(&sh->hold, __ATOMIC_SEQ_CST))
+				futex(&sh->hold, FUTEX_WAIT_PRIVATE, 1, NULL);
+		}
+		else if (held == NULL)
+		{
+			apply_fn(r);
+			complete(r);
+		}
+		else
+		{
+			apply_fn(r);
+			if (nheld == 0)
+				deadline = now_ns() + net_ns;
+			held[nheld++] = r;
+			if (nheld == SEQ_RING || now_ns() >= deadline)
+				release(sh, held, &nheld);
+		}
+	}
+	return NULL;
+}
+
+// Start nshards sequencer threads that call apply for every published
+// request. With window_ns above 0, applied requests are held for up to that
+// long and passed to flush before they are completed.
+void seq_init(int nshards, seq_apply_t* apply, seq_flush_t* flush, long window_ns)
+{
+	pthread_t tid;
+	int i;
+
+	if (posix_memalign((void**)&shards, 64, sizeof(shard_t) * nshards) != 0)
+		unix_error("posix_memalign error");
+	memset(shards, 0, sizeof(shard_t) * nshards);
+	apply_fn = apply;
+	flush_fn = flush;
+	net_ns = window_ns;
+	spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN : 0;   // On one CPU the other side cannot move while we spin
+	for (i = 0; i < nshards; i++)
+		Pthread_create(&tid, NULL, sequencer, &shards[i]);
+}
+
+// Queue r on shard. Requests of one shard are applied in the order they were
+// published; r must stay alive until seq_wait() returns.
+void seq_publish(int shard, seq_req_t* r)
+{
+	shard_t* sh = &shards[shard];
+	unsigned int s = __atomic_fetch_add(&sh->claim, 1, __ATOMIC_RELAXED);
+	seq_slot_t* slot = &sh->slots[s % SEQ_RING];
+
+	while (s - __atomic_load_n(&sh->next, __ATOMIC_ACQUIRE) >= SEQ_RING)   // Ring full: wait for the slot's last lap
+		sched_yield();
+	r->done = 0;
+	slot->req = r;
+	__atomic_store_n(&slot->seq, s + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sh->sleeping, __ATOMIC_SEQ_CST))
+		futex(&slot->seq, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
+
+// Wait until the sequencer has applied r
+void seq_wait(seq_req_t* r)
+{
+	unsigned int zero = 0;
+	int i;
+
+	for (i = 0; i < spin && !__atomic_load_n(&r->done, __ATOMIC_ACQUIRE); i++)
+		cpu_relax();
+	while (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE) != 1)
+	{
+		if (__atomic_compare_exchange_n(&r->done, &zero, 2, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) || zero == 2)
+			futex(&r->done, FUTEX_WAIT_PRIVATE, 2, NULL);
+		zero = 0;
+	}
+}
+
+// Stop shard once everything published before has been applied, and return
+// with nothing of it running; the caller then owns the shard's instruments
+// until seq_unpark()
+void seq_park(int shard)
+{
+	seq_req_t r;
+
+	r.op = SEQ_PARK;
+	seq_publish(shard, &r);
+	seq_wait(&r);
+}
+
+void seq_unpark(int shard)
+{
+	__atomic_store_n(&shards[shard].hold, 0, __ATOMIC_SEQ_CST);
+	futex(&shards[shard].hold, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
@@ -0,0 +1,46 @@
+/*
+ * sequencer.h - one single-writer sequencer thread per shard, fed by a ring
+ *
+ * With --engine=sequencer the worker threads only parse commands and publish
+ * them into the ring of the shard that owns the instrument. The shard's
+ * sequencer thread is the only thread that changes its instruments, so it
+ * applies them in ring order without taking any lock, and hands each result
+ * back to the worker that published it.
+ *
+ * With a netting window the sequencer holds results back instead: requests
+ * are applied as they come, but completed together once the window that the
+ * first of them opened has passed, after a flush call that can write their
+ * combined effect in one go.
+ */
+#ifndef __SEQUENCER_H__
+#define __SEQUENCER_H__
+
+#include "csapp.h"
+
+#define SEQ_RING   4096      // Slots per shard ring, a power of two
+#define SHARDS_MAX 64
+
+typedef struct {
+	int op;                  // Up to the apply function
+	void* item;
+	int stock_num;
+	int account_id;          // Account to charge, up to the apply function as well
+	int result;              // Filled in by the apply function
+	long long ticket;        // Likewise: journal ticket to wait for before replying
+	unsigned int done;       // 0 while pending, 1 once applied, 2 while the submitter sleeps on it
+} seq_req_t;
+
+// Apply one request; runs on the shard's sequencer thread
+typedef void seq_apply_t(seq_req_t* r);
+
+// Make the n requests applied in a netting window final, before they are
+// completed; runs on the shard's sequencer thread
+typedef void seq_flush_t(int shard, seq_req_t** reqs, int n);
+
+void seq_init(int nshards, seq_apply_t* apply, seq_flush_t* flush, long window_ns);
+void seq_publish(int shard, seq_req_t* r);
+void seq_wait(seq_req_t* r);
+void seq_park(int shard);
+void seq_unpark(int shard);
+
+#endif /* __SEQUENCER_H__ */
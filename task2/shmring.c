@@ -0,0 +1,185 @@
+/*
+ * shmring.c - shared-memory ring pair for clients on the same host
+ *
+ * A round trip through the rings is two memcpy's and two counter stores when
+ * the other side is spinning, and one futex wake per direction when it sleeps:
+ * no socket buffers, no TCP or AF_UNIX stack on the way.
+ */
+#include "shmring.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <limits.h>
+
+#define SPIN 2000           // Polls of the counter before going to sleep on it, with a CPU to spare
+#define WAIT_MS 100         // Sleep at most this long between checks on the peer
+
+static int futex(unsigned int* addr, int op, unsigned int val, const struct timespec* ts)
+{
+	return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+
+// The peer's socket has hung up or reached end of file
+static int peer_gone(int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	char c;
+
+	if (poll(&pfd, 1, 0) <= 0)
+		return 0;
+	if (pfd.revents & (POLLHUP | POLLERR))
+		return 1;
+	return (pfd.revents & POLLIN) && recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+// Wait until *word is no longer seen. Returns -1 if the pair was closed or the
+// peer behind peer_fd (-1 for none) is gone.
+static int ring_wait(shm_pair_t* p, unsigned int* word, unsigned int* waiters, unsigned int seen, int peer_fd)
+{
+	static int spin = -1;   // On one CPU the peer cannot move while we spin
+	struct timespec ts = { 0, WAIT_MS * 1000000L };
+	int i;
+
+	if (spin < 0)
+		spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN : 0;
+	for (i = 0; i < spin; i++)
+	{
+		if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen)
+			return 0;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+	while (1)
+	{
+		if (__atomic_load_n(&p->closed, __ATOMIC_ACQUIRE))
+			return -1;
+		__atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == seen)
+			futex(word, FUTEX_WAIT, seen, &ts);   // Returns at once if *word moved meanwhile
+		__atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen)
+			return 0;
+		if (peer_fd >= 0 && peer_gone(peer_fd))
+			return -1;
+	}
+}
+
+static void ring_wake(unsigned int* word, unsigned int* waiters)
+{
+	if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+		futex(word, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+// Copy n bytes into r, waiting for room as needed. Returns -1 if the pair was
+// closed or the peer is gone, 0 otherwise.
+int ring_write(shm_pair_t* p, ring_t* r, const void* buf, int n, int peer_fd)
+{
+	const char* src = buf;
+
+	while (n > 0)
+	{
+		unsigned int head = r->head;
+		unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		unsigned int room = RING_SIZE - (head - tail), off = head % RING_SIZE, chunk;
+
+		if (room == 0)
+		{
+			if (ring_wait(p, &r->tail, &r->tail_waiters, tail, peer_fd) < 0)
+				return -1;
+			continue;
+		}
+		chunk = n < room ? n : room;
+		if (chunk > RING_SIZE - off)
+			chunk = RING_SIZE - off;
+		memcpy(r->data + off, src, chunk);
+		__atomic_store_n(&r->head, head + chunk, __ATOMIC_SEQ_CST);
+		ring_wake(&r->head, &r->head_waiters);
+		src += chunk;
+		n -= chunk;
+	}
+	return 0;
+}
+
+// Copy n bytes out of r, waiting for them as needed. Returns n, or 0 if the
+// pair was closed or the peer is gone first.
+int ring_read(shm_pair_t* p, ring_t* r, void* buf, int n, int peer_fd)
+{
+	char* dst = buf;
+	int left = n;
+
+	while (left > 0)
+	{
+		unsigned int tail = r->tail;
+		unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		unsigned int fill = head - tail, off = tail % RING_SIZE, chunk;
+
+		if (fill == 0)
+		{
+			if (ring_wait(p, &r->head, &r->head_waiters, head, peer_fd) < 0)
+				return 0;
+			continue;
+		}
+		chunk = left < fill ? left : fill;
+		if (chunk > RING_SIZE - off)
+			chunk = RING_SIZE - off;
+		memcpy(dst, r->data + off, chunk);
+		__atomic_store_n(&r->tail, tail + chunk, __ATOMIC_SEQ_CST);
+		ring_wake(&r->tail, &r->tail_waiters);
+		dst += chunk;
+		left -= chunk;
+	}
+	return n;
+}
+
+// Map the pair open on fd and close fd. Returns NULL if it cannot be mapped.
+static shm_pair_t* shm_map(int fd)
+{
+	void* addr = mmap(NULL, sizeof(shm_pair_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	Close(fd);
+	return addr == MAP_FAILED ? NULL : (shm_pair_t*)addr;
+}
+
+// Create a fresh ring pair and store its name, at most 64 bytes, in name.
+// Returns NULL, leaving nothing behind, if the system has no room for it.
+shm_pair_t* shm_pair_create(char* name)
+{
+	static int next = 0;
+	shm_pair_t* p = NULL;
+	int fd;
+
+	sprintf(name, "/stockserver.%d.%d", (int)getpid(), __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED));
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+		return NULL;
+	if (ftruncate(fd, sizeof(shm_pair_t)) < 0)   // Zero filled: both rings empty
+		Close(fd);
+	else
+		p = shm_map(fd);
+	if (p == NULL)
+		shm_unlink(name);
+	return p;
+}
+
+shm_pair_t* shm_pair_attach(const char* name)
+{
+	shm_pair_t* p;
+	int fd;
+
+	if ((fd = shm_open(name, O_RDWR, 0)) < 0)
+		unix_error("shm_open error");
+	if ((p = shm_map(fd)) == NULL)
+		unix_error("shm mmap error");
+	return p;
+}
+
+// Tell the other side this one is leaving, wake it and unmap
+void shm_pair_close(shm_pair_t* p)
+{
+	__atomic_store_n(&p->closed, 1, __ATOMIC_SEQ_CST);
+	futex(&p->req.head, FUTEX_WAKE, INT_MAX, NULL);
+	futex(&p->req.tail, FUTEX_WAKE, INT_MAX, NULL);
+	futex(&p->resp.head, FUTEX_WAKE, INT_MAX, NULL);
+	futex(&p->resp.tail, FUTEX_WAKE, INT_MAX, NULL);
+	Munmap(p, sizeof(shm_pair_t));
+}
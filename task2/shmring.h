@@ -0,0 +1,46 @@
+/*
+ * shmring.h - shared-memory ring pair for clients on the same host
+ *
+ * A client that sends "shm\n" on a text connection and reads back
+ * "shm ok <name>\n" maps the POSIX shared memory object <name> and from then
+ * on exchanges the binary frames of proto.h through two single-producer,
+ * single-consumer byte rings instead of the socket. The socket stays open: the
+ * server takes its end of file as the client going away.
+ */
+#ifndef __SHMRING_H__
+#define __SHMRING_H__
+
+#include "csapp.h"
+
+#define SHM_HELLO    "shm\n"
+#define SHM_HELLO_OK "shm ok "     // Followed by the object name and a newline
+
+#define RING_SIZE 65536            // Bytes per ring, a power of two
+
+// head and tail run freely and wrap at 2^32; head - tail is the fill level.
+// Each side sleeps in a futex on the other side's counter once spinning has
+// not helped, after announcing itself in the matching waiters count.
+typedef struct {
+	unsigned int head;             // Bytes written, advanced by the producer only
+	unsigned int head_waiters;     // Consumers asleep on head
+	char pad0[56];
+	unsigned int tail;             // Bytes read, advanced by the consumer only
+	unsigned int tail_waiters;     // Producers asleep on tail
+	char pad1[56];
+	char data[RING_SIZE];
+} ring_t;
+
+typedef struct {
+	ring_t req;                    // Client to server
+	ring_t resp;                   // Server to client
+	int closed;                    // Set by whichever side leaves first
+} shm_pair_t;
+
+shm_pair_t* shm_pair_create(char* name);
+shm_pair_t* shm_pair_attach(const char* name);
+void shm_pair_close(shm_pair_t* p);
+
+int ring_write(shm_pair_t* p, ring_t* r, const void* buf, int n, int peer_fd);
+int ring_read(shm_pair_t* p, ring_t* r, void* buf, int n, int peer_fd);
+
+#endif /* __SHMRING_H__ */
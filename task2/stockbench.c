@@ -0,0 +1,284 @@
+/*
+ * stockbench.c - closed-loop order load generator
+ *
+ * Each client thread opens one connection and sends buy/sell orders one at a
+ * time, timing every round trip. Reports throughput and latency percentiles.
+ * With --binary the connections negotiate the binary protocol of proto.h; with
+ * --batch=N every round trip carries a "batch N" command of N orders, and each
+ * of them is charged the round trip's latency. --watchers=N opens N more
+ * connections that watch instrument 1 and are drained by one reader thread,
+ * to show what fan-out to a hot instrument costs the order path.
+ *
+ * --unix=PATH connects to the server's AF_UNIX socket instead of host:port, and
+ * --shm moves each connection onto a shared-memory ring pair (binary frames).
+ * --show replaces every order with a show, to measure a show storm.
+ */
+#include "csapp.h"
+#include "proto.h"
+#include "shmring.h"
+#include <sys/un.h>
+#include <time.h>
+#include <poll.h>
+
+#define BUY_SELL_MAX 10
+#define SHOW_LINE (4 << 20)   // Longest show reply --show can read
+
+char* host;
+char* port;
+int order_num;          // Orders per client
+int stock_num;          // Orders pick stock_id 1..stock_num
+int binary = 0;         // Use binary frames instead of text lines
+int batch = 1;          // Orders per round trip
+long wire_bytes = 0;    // Bytes sent and received by all clients
+char* unix_path = NULL; // Connect to this AF_UNIX socket instead of host:port
+int use_shm = 0;        // Exchange binary frames through a shared-memory ring pair
+int show_only = 0;      // Send show instead of orders
+int watcher_num = 0;    // Connections watching instrument 1
+long updates = 0;       // Update lines the watchers received
+long* latency;          // Round trip of every order in ns, client i owns [i * order_num, (i + 1) * order_num)
+
+long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int open_unix_clientfd(char* path)
+{
+	struct sockaddr_un addr;
+	int fd = Socket(AF_UNIX, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	Connect(fd, (SA*)&addr, sizeof(addr));
+	return fd;
+}
+
+int connect_server()
+{
+	return unix_path ? open_unix_clientfd(unix_path) : Open_clientfd(host, port);
+}
+
+// Send a binary frame over the socket, or the ring pair once there is one
+void frame_send(int fd, shm_pair_t* shm, void* buf, int n)
+{
+	if (shm)
+	{
+		if (ring_write(shm, &shm->req, buf, n, fd) < 0)
+			app_error("server closed the connection");
+	}
+	else
+		Rio_writen(fd, buf, n);
+}
+
+void frame_recv(rio_t* rio, shm_pair_t* shm, void* buf, int n)
+{
+	if (shm ? ring_read(shm, &shm->resp, buf, n, rio->rio_fd) != n : Rio_readnb(rio, buf, n) != n)
+		app_error("server closed the connection");
+}
+
+void* client(void* vargp)
+{
+	long id = (long)vargp;
+	unsigned int seed = (unsigned int)id + 1;
+	char buf[MAXLINE];
+	char* req = Malloc(32 + batch * 32);
+	rio_t rio;
+	long bytes = 0;
+	shm_pair_t* shm = NULL;
+	char* show_line = show_only ? Malloc(SHOW_LINE) : NULL;
+	int i, j, clientfd = connect_server();
+
+	Rio_readinitb(&rio, clientfd);
+	if (use_shm)
+	{
+		Rio_writen(clientfd, SHM_HELLO, strlen(SHM_HELLO));
+		if (Rio_readlineb(&rio, buf, MAXLINE) == 0 || strncmp(buf, SHM_HELLO_OK, strlen(SHM_HELLO_OK)))
+			app_error("server does not offer shared-memory rings");
+		buf[strlen(buf) - 1] = '\0';
+		shm = shm_pair_attach(buf + strlen(SHM_HELLO_OK));
+	}
+	else if (binary)
+	{
+		Rio_writen(clientfd, BIN_HELLO, strlen(BIN_HELLO));
+		if (Rio_readlineb(&rio, buf, MAXLINE) == 0 || strcmp(buf, BIN_HELLO_OK))
+			app_error("server does not speak the binary protocol");
+	}
+	for (i = 0; batch == 1 && i < order_num; i++)
+	{
+		int type = rand_r(&seed) % 2 ? BIN_BUY : BIN_SELL;
+		int stock_id = rand_r(&seed) % stock_num + 1;
+		int num = rand_r(&seed) % BUY_SELL_MAX + 1;
+		long start = now_ns();
+
+		if (binary)
+		{
+			struct {
+				bin_hdr_t hdr;
+				bin_order_t order;
+			} req = { { htole16(sizeof(bin_order_t)), type, 0 }, { htole32(stock_id), htole32(num) } };
+			bin_hdr_t resp;
+
+			frame_send(clientfd, shm, &req, sizeof(req));
+			frame_recv(&rio, shm, &resp, sizeof(resp));
+			bytes += sizeof(req) + sizeof(resp);
+		}
+		else if (show_only)
+		{
+			Rio_writen(clientfd, "show\n", strlen("show\n"));
+			if (Rio_readlineb(&rio, show_line, SHOW_LINE) == 0)
+				app_error("server closed the connection");
+			bytes += strlen("show\n") + strlen(show_line);
+		}
+		else
+		{
+			int len = sprintf(buf, "%s %d %d\n", type == BIN_BUY ? "buy" : "sell", stock_id, num);
+
+			Rio_writen(clientfd, buf, len);
+			if (Rio_readlineb(&rio, buf, MAXLINE) == 0)
+				app_error("server closed the connection");
+			bytes += len + strlen(buf);
+		}
+		latency[id * order_num + i] = now_ns() - start;
+	}
+	for (; i < order_num; i += batch)
+	{
+		long start = now_ns();
+		int len = sprintf(req, "batch %d\n", batch);
+
+		for (j = 0; j < batch; j++)
+			len += sprintf(req + len, "%s %d %d\n", rand_r(&seed) % 2 ? "buy" : "sell",
+				rand_r(&seed) % stock_num + 1, rand_r(&seed) % BUY_SELL_MAX + 1);
+		Rio_writen(clientfd, req, len);
+		if (Rio_readlineb(&rio, buf, MAXLINE) == 0)
+			app_error("server closed the connection");
+		bytes += len + strlen(buf);
+		start = now_ns() - start;
+		for (j = 0; j < batch; j++)
+			latency[id * order_num + i + j] = start;
+	}
+	__atomic_add_fetch(&wire_bytes, bytes, __ATOMIC_RELAXED);
+	if (shm)
+		shm_pair_close(shm);
+	if (show_line)
+		Free(show_line);
+	Free(req);
+	Close(clientfd);
+	return NULL;
+}
+
+// Read and count updates on every watcher connection until the process exits
+void* drain(void* vargp)
+{
+	struct pollfd* pfds = (struct pollfd*)vargp;
+	char buf[65536];
+	int i, j;
+	ssize_t n;
+
+	while (poll(pfds, watcher_num, -1) > 0)
+	{
+		for (i = 0; i < watcher_num; i++)
+		{
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+			if ((n = read(pfds[i].fd, buf, sizeof(buf))) <= 0)
+				pfds[i].fd = -1;
+			for (j = 0; j < n; j++)
+				updates += buf[j] == '\n';
+		}
+	}
+	return NULL;
+}
+
+// Open watcher_num connections that watch instrument 1 and start draining them
+void start_watchers()
+{
+	struct pollfd* pfds = Malloc(sizeof(struct pollfd) * watcher_num);
+	char buf[MAXLINE];
+	pthread_t tid;
+	rio_t rio;
+	int i;
+
+	for (i = 0; i < watcher_num; i++)
+	{
+		pfds[i].fd = connect_server();
+		pfds[i].events = POLLIN;
+		Rio_writen(pfds[i].fd, "watch 1\n", strlen("watch 1\n"));
+		Rio_readinitb(&rio, pfds[i].fd);
+		if (Rio_readlineb(&rio, buf, MAXLINE) == 0 || strncmp(buf, "[watch]", 7))
+			app_error("server does not support watch");
+	}
+	Pthread_create(&tid, NULL, drain, pfds);
+}
+
+int long_less(const void* a, const void* b)
+{
+	long x = *(long*)a, y = *(long*)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char** argv)
+{
+	int i, num_client;
+	long start, elapsed, total;
+	pthread_t* tids;
+
+	if (argc < 5)
+	{
+		fprintf(stderr, "usage: %s <host> <port> <client#> <order#> [stock#] [--binary] [--batch=N] [--watchers=N] [--unix=PATH] [--shm] [--show]\n", argv[0]);
+		exit(0);
+	}
+	host = argv[1];
+	port = argv[2];
+	num_client = atoi(argv[3]);
+	order_num = atoi(argv[4]);
+	stock_num = 5;
+	for (i = 5; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--binary"))
+			binary = 1;
+		else if (!strncmp(argv[i], "--batch=", 8))
+			batch = atoi(argv[i] + 8);
+		else if (!strncmp(argv[i], "--unix=", 7))
+			unix_path = argv[i] + 7;
+		else if (!strcmp(argv[i], "--show"))
+			show_only = 1;
+		else if (!strcmp(argv[i], "--shm"))
+			binary = use_shm = 1;
+		else if (!strncmp(argv[i], "--watchers=", 11))
+			watcher_num = atoi(argv[i] + 11);
+		else
+			stock_num = atoi(argv[i]);
+	}
+	if (batch < 1 || (batch > 1 && binary))
+		app_error("--batch=N needs N >= 1 and the text protocol");
+	if (show_only && (binary || batch > 1))
+		app_error("--show needs the text protocol without --batch");
+	order_num -= order_num % batch;   // Whole batches only
+	total = (long)num_client * order_num;
+	latency = Malloc(sizeof(long) * total);
+	tids = Malloc(sizeof(pthread_t) * num_client);
+	if (watcher_num > 0)
+		start_watchers();
+
+	start = now_ns();
+	for (i = 0; i < num_client; i++)
+		Pthread_create(&tids[i], NULL, client, (void*)(long)i);
+	for (i = 0; i < num_client; i++)
+		Pthread_join(tids[i], NULL);
+	elapsed = now_ns() - start;
+
+	qsort(latency, total, sizeof(long), long_less);
+	printf("%ld orders in %.3f s: %.0f orders/s, p50 %.1f us, p99 %.1f us, max %.1f us, %.1f bytes/order\n",
+		total, elapsed / 1e9, total / (elapsed / 1e9), latency[total / 2] / 1e3,
+		latency[total * 99 / 100] / 1e3, latency[total - 1] / 1e3, (double)wire_bytes / total);
+	if (watcher_num > 0)
+		printf("%d watchers received %ld updates\n", watcher_num, updates);
+
+	Free(tids);
+	Free(latency);
+	return 0;
+}
@@ -4,27 +4,42 @@
 /* $begin echoserverimain */
 
 #include "csapp.h"
+#include "engine.h"
+#include "parse.h"
+#include "watch.h"
+#include "shmring.h"
+#include "sequencer.h"
+#include "cmdlog.h"
+#include "reactor.h"
+#include "limit.h"
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
 #define SBUFSIZE 1024
-
-typedef struct stock_item* stock_link;
-typedef struct stock_item {
-	int stock_id;           // Stock ID
-	int left_stock;         // Number of stocks left
-	int stock_price;        // Stock price
-	int stock_readcnt;      // Read count of the stock
-	sem_t mutex;            // Mutex semaphore for controlling access to the stock
-	sem_t writer;           // Writer semaphore for controlling write access to the stock
-	stock_link left;        // Pointer to the left child in the binary tree
-	stock_link right;       // Pointer to the right child in the binary tree
-	stock_link next;        // Pointer to the next stock item (temporary, used when creating a list)
-} STOCK_ITEM;
-
-int total_stock_num = 0;    // Total number of stock items
-STOCK_ITEM* stock_head = NULL;    // Pointer to the head of the stock list
-STOCK_ITEM* stock_tail = NULL;    // Pointer to the tail of the stock list
-STOCK_ITEM* root = NULL;    // Pointer to the root of the binary tree
-
-sem_t file_mutex;    // Mutex semaphore for controlling access to the file
+#define BUSY_BACKLOG 1024   // Default --busy-backlog
+
+#ifndef MODEL_DEFAULT
+#define MODEL_DEFAULT MODEL_THREADPOOL   // task1 builds this server with MODEL_SELECT
+#endif
+
+engine_config_t config = { PERSIST_REWRITE, DURABILITY_MEMORY, ENGINE_LOCKED, 4, watch_changed, "accounts.txt", COMBINE_NS };   // Selected with --persist, --durability, --engine, --shards, --accounts, --combine-ns and --net-us
+
+int draining = 0;                      // Set when shutdown starts; connections take no new commands after it
+int inflight = 0;                      // Commands being executed right now
+int drain_ms = 5000;                   // Selected with --drain-ms=N: how long shutdown waits for inflight to reach 0
+char* record_path = NULL;              // Selected with --record=PATH: log every command received, see cmdlog.h
+char* unix_path = NULL;                // Selected with --unix=PATH: also listen on an AF_UNIX socket there
+int unix_listenfd = -1;
+int model = MODEL_DEFAULT;              // Selected with --model: how connections are served, see reactor.h
+int nreactors = 0;                     // Selected with --reactors=N: MODEL_MULTIREACTOR threads, 0 for one per CPU
+int conn_rate = 0;                     // Selected with --rate=N: commands per second of a connection, 0 for no limit
+int ip_rate = 0;                       // Selected with --ip-rate=N: commands per second of a client address, 0 for no limit
+int burst = LIMIT_BURST;               // Selected with --burst=N: commands either may send at once
+int busy_queue = SBUFSIZE;             // Selected with --busy-queue=N: connections waiting for a worker before new ones get busy
+int busy_backlog = -1;                 // Selected with --busy-backlog=N: ready connections behind the one served before its commands get busy, 0 never, -1 for BUSY_BACKLOG or the model's most
+
+int begin_command();
+void end_command();
 
 typedef struct {
 	int* buf;         // Buffer for storing integers
@@ -47,14 +62,6 @@ void sbuf_init(sbuf_t* sp, int n)
 	Sem_init(&sp->items, 0, 0);         // Initialize the items semaphore with value 0
 }
 
-void sig_int_handler(int sig)
-{
-	update_file();            // Call a function to update the file
-	sbuf_deinit(&sbuf);       // Deinitialize the bounded buffer
-	free_tree(root);          // Free the memory used by the binary tree
-	exit(0);                  // Exit the program
-}
-
 void sbuf_deinit(sbuf_t* sp)
 {
 	Free(sp->buf);   // Free the memory allocated for the buffer
@@ -69,6 +76,15 @@ void sbuf_insert(sbuf_t* sp, int item)
 	V(&sp->items);          // Signal that an item is available in the buffer
 }
 
+// Items waiting to be removed
+int sbuf_count(sbuf_t* sp)
+{
+	int n;
+
+	sem_getvalue(&sp->items, &n);
+	return n;
+}
+
 int sbuf_remove(sbuf_t *sp)
 {
 	int item;
@@ -80,344 +96,1014 @@ int sbuf_remove(sbuf_t *sp)
 	return item;            // Return the removed item
 }
 
-void free_tree(STOCK_ITEM* ptr)
+
+// A rendered show reply. Immutable once published; freed by whoever drops the
+// last reference.
+typedef struct {
+	int refcnt;
+	int len;
+	char data[];
+} show_buf_t;
+
+pthread_mutex_t show_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t show_cond = PTHREAD_COND_INITIALIZER;   // Broadcast when a render is published
+show_buf_t* show_last = NULL;   // Latest render, holds one reference
+long long show_done = 0;        // Renders published so far
+int show_busy = 0;              // A render is running
+
+show_buf_t* show_render()
 {
-	if (ptr)
-	{
-		free_tree(ptr->left);    // Recursively free the left subtree
-		free_tree(ptr->right);   // Recursively free the right subtree
-		free(ptr);               // Free the memory allocated for the current node
-	}
+	show_buf_t* b = Malloc(sizeof(show_buf_t) + engine_show_max());
+
+	b->refcnt = 1;
+	b->len = engine_show(b->data);
+	return b;
 }
 
-void stock_add_to_list(int stock_id, int left_stock, int stock_price)
+void show_release(show_buf_t* b)
 {
-	STOCK_ITEM* item = (STOCK_ITEM*)malloc(sizeof(STOCK_ITEM));   // Allocate memory for a new stock item
-	item->stock_id = stock_id;                                    // Set the stock ID
-	item->left_stock = left_stock;                                // Set the number of stocks left
-	item->stock_price = stock_price;                              // Set the stock price
-	total_stock_num++;                                            // Increment the total stock count
+	if (__atomic_sub_fetch(&b->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		Free(b);
+}
 
-	if (stock_head == NULL)  // If the list is empty, set both head and tail to the new item
-	{
-		stock_head = item;
-		stock_tail = item;
-	}
-	else  // Otherwise, append the new item to the tail of the list
+// Get a show reply rendered after this call began, sharing the render with every
+// concurrent caller: the first one to find no render running walks the tree for
+// all of them. One already running when the call began may have passed stocks
+// the caller changed just before, so the caller waits for the one after it.
+// Release the result with show_release().
+show_buf_t* show_acquire()
+{
+	show_buf_t* b;
+	long long target;
+
+	pthread_mutex_lock(&show_lock);
+	target = show_done + (show_busy ? 2 : 1);
+	while (show_done < target)
 	{
-		stock_tail->next = item;
-		stock_tail = item;
+		if (show_busy)
+		{
+			pthread_cond_wait(&show_cond, &show_lock);
+			continue;
+		}
+		show_busy = 1;
+		pthread_mutex_unlock(&show_lock);
+		b = show_render();
+		pthread_mutex_lock(&show_lock);
+		if (show_last)
+			show_release(show_last);
+		show_last = b;
+		show_done++;
+		show_busy = 0;
+		pthread_cond_broadcast(&show_cond);
 	}
+	b = show_last;
+	__atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&show_lock);
+	return b;
 }
 
-int less(void* a, void* b)
+void show(int fd)
 {
-	return (*(STOCK_ITEM*)a).stock_id - (*(STOCK_ITEM*)b).stock_id;  // Compare stock IDs and return the result
+	show_buf_t* b = show_acquire();
+
+	Rio_writen(fd, b->data, b->len);   // Write the stock information to the specified file descriptor
+	show_release(b);
 }
 
-STOCK_ITEM* stock_arr_to_bst(STOCK_ITEM* stock_arr, int start, int end)
+void show_since(int fd, long long since)
 {
-	if (start > end)  // Base case: If the start index exceeds the end index, return NULL
-		return NULL;
+	char* buf = Malloc(engine_show_max());
 
-	int mid = (start + end) / 2;  // Calculate the middle index
-
-	STOCK_ITEM* item = (STOCK_ITEM*)malloc(sizeof(STOCK_ITEM));  // Allocate memory for a new stock item
-	item->stock_id = stock_arr[mid].stock_id;                     // Set the stock ID
-	item->left_stock = stock_arr[mid].left_stock;                 // Set the number of stocks left
-	item->stock_price = stock_arr[mid].stock_price;               // Set the stock price
-	item->next = NULL;
-	item->stock_readcnt = 0;
-	Sem_init(&item->mutex, 0, 1);    // Initialize the mutex semaphore with value 1
-	Sem_init(&item->writer, 0, 1);   // Initialize the writer semaphore with value 1
+	Rio_writen(fd, buf, engine_since(since, buf));
+	Free(buf);
+}
 
-	// Recursively build the binary search tree
-	item->left = stock_arr_to_bst(stock_arr, start, mid - 1);   // Build the left subtree
-	item->right = stock_arr_to_bst(stock_arr, mid + 1, end);    // Build the right subtree
+// Turn an order line of a batch or multi-leg order into an engine order
+void parse_order(char* line, int len, engine_order_t* order)
+{
+	command_t cmd;
 
-	return item;   // Return the root of the constructed binary search tree
+	parse_command(line, len, &cmd);
+	order->side = cmd.verb == CMD_BUY ? ORDER_BUY : cmd.verb == CMD_SELL ? ORDER_SELL : 0;
+	order->stock_id = cmd.stock_id;
+	order->stock_num = cmd.stock_num;
 }
 
-void stock_list_to_bst()
+// Execute the n orders of a batch and answer with one line:
+// "[batch] <succeeded>/<n> success" followed by the RESULT_* of each order in
+// submission order.
+void batch(int fd, int account_id, engine_order_t* orders, int n)
 {
-	STOCK_ITEM* stock_arr = (STOCK_ITEM*)malloc(sizeof(STOCK_ITEM) * total_stock_num);   // Allocate memory for an array of STOCK_ITEM objects
-	STOCK_ITEM* ptr = stock_head;
-	int i;
+	char reply[32 + 2 * BATCH_MAX];
+	int i, len, ok = 0;
 
-	for (i = 0; i < total_stock_num; i++)
+	engine_batch(account_id, orders, n);
+
+	for (i = 0; i < n; i++)
+		ok += orders[i].result == RESULT_OK;
+	len = sprintf(reply, "[batch] %d/%d success", ok, n);
+	for (i = 0; i < n; i++)
 	{
-		STOCK_ITEM* prev_ptr = ptr;
-		stock_arr[i].stock_id = ptr->stock_id;               // Copy the stock ID to the array
-		stock_arr[i].left_stock = ptr->left_stock;           // Copy the number of stocks left to the array
-		stock_arr[i].stock_price = ptr->stock_price;         // Copy the stock price to the array
-		ptr = ptr->next;
-		free(prev_ptr);                                      // Free the memory of the current list item as it has been moved to the array
+		reply[len++] = ' ';
+		reply[len++] = '0' + orders[i].result;
 	}
+	reply[len++] = '\n';
+	Rio_writen(fd, reply, len);
+}
 
-	stock_head = NULL;
-	stock_tail = NULL;
+// Text of an order's RESULT_*, as answered for a failed buy, sell or leg
+const char* result_text(int result)
+{
+	switch (result)
+	{
+	case RESULT_NO_STOCK:
+		return "stock_id not exists";
+	case RESULT_NOT_ENOUGH:
+		return "Not enough left stocks";
+	case RESULT_NO_CASH:
+		return "Not enough cash";
+	case RESULT_NO_POSITION:
+		return "Not enough stocks held";
+	case RESULT_BUSY:
+		return "busy";
+	default:
+		return "invalid command";
+	}
+}
 
-	// Sort the array in ascending order based on stock IDs
-	qsort(stock_arr, total_stock_num, sizeof(STOCK_ITEM), less);
+// Execute the n legs of a multi-leg order and answer "[multi] success", or
+// "[multi] failed leg <i>: <reason>" with i counted from 1 and nothing applied.
+void multi(int fd, int account_id, engine_order_t* legs, int n)
+{
+	char reply[MAXLINE];
+	int failed, result;
 
-	// Construct the binary search tree (BST) based on the sorted array
-	root = stock_arr_to_bst(stock_arr, 0, total_stock_num - 1);
+	result = engine_multi(account_id, legs, n, &failed);
 
-	free(stock_arr);   // Free the memory allocated for the array as the BST has been constructed
+	if (result == RESULT_OK)
+		strcpy(reply, "[multi] success\n");
+	else
+		sprintf(reply, "[multi] failed leg %d: %s\n", failed + 1, result_text(result));
+	Rio_writen(fd, reply, strlen(reply));
 }
 
+// Update line pushed to watchers, with the latest values: engine_stock() does
+// not queue behind a writer that is syncing the journal.
+int format_update(int idx, char* buf)
+{
+	engine_stock_t s;
+
+	engine_stock(idx, &s);
+	return sprintf(buf, "[update] %d %d %d\n", s.stock_id, s.left_stock, s.stock_price);
+}
 
-void inorder(char* stocks, STOCK_ITEM* ptr)
+// Subscribe the connection to the instruments of a watch command. Unknown
+// stock_ids are skipped and counted in the reply.
+void watch(int fd, watch_t* w, command_t* cmd)
 {
-	char temp[100];
+	char reply[MAXLINE];
+	const char* p = cmd->args;
+	int i, id, missing = 0;
 
-	if (ptr)
+	if (cmd->count == WATCH_ALL)
 	{
-		inorder(stocks, ptr->left);   // Traverse the left subtree
+		watch_add_all(w);
+		sprintf(reply, "[watch] watching all %d instruments\n", engine_count());
+	}
+	else
+	{
+		for (i = 0; i < cmd->count; i++)
+		{
+			int idx;
 
-		P(&(ptr->mutex));             // Acquire the mutex semaphore to protect access to stock_readcnt
-		ptr->stock_readcnt++;
+			p = parse_int(p, cmd->end, &id);
+			if ((idx = engine_find(id)) >= 0)
+				watch_add(w, idx);
+			else
+				missing++;
+		}
+		sprintf(reply, "[watch] watching %d instruments, %d stock_id not exists\n", w->all ? engine_count() : w->nidxs, missing);
+	}
+	Rio_writen(fd, reply, strlen(reply));
+}
 
-		if (ptr->stock_readcnt == 1)   // If this is the first reader
-			P(&(ptr->writer));         // Acquire the writer semaphore to block writers
+void buy(int fd, int account_id, int stock_id, int stock_num)
+{
+	char reply[MAXLINE];
+	int result = engine_buy(account_id, stock_id, stock_num);
 
-		V(&(ptr->mutex));             // Release the mutex semaphore
+	if (result == RESULT_OK)
+		strcpy(reply, "[buy] success\n");
+	else
+		sprintf(reply, "%s\n", result_text(result));
+	Rio_writen(fd, reply, strlen(reply));
+}
 
-		// Critical Section: Reading
-		sprintf(temp, "%d %d %d	", ptr->stock_id, ptr->left_stock, ptr->stock_price);
-		strcat(stocks, temp);
-		// End of Critical Section: Reading
+void sell(int fd, int account_id, int stock_id, int stock_num)
+{
+	char reply[MAXLINE];
+	int result = engine_sell(account_id, stock_id, stock_num);
 
-		P(&(ptr->mutex));             // Acquire the mutex semaphore to protect access to stock_readcnt
-		ptr->stock_readcnt--;
+	if (result == RESULT_OK)
+		strcpy(reply, "[sell] success\n");
+	else
+		sprintf(reply, "%s\n", result_text(result));
+	Rio_writen(fd, reply, strlen(reply));
+}
+
+void deposit(int fd, int account_id, long long amount)
+{
+	char reply[MAXLINE];
+	long long cash;
+	int result;
 
-		if (ptr->stock_readcnt == 0)   // If there are no more readers
-			V(&(ptr->writer));         // Release the writer semaphore to unblock writers
+	if (account_id == ACCOUNT_NONE)
+	{
+		Rio_writen(fd, "no account\n", strlen("no account\n"));
+		return;
+	}
+	result = engine_deposit(account_id, amount, &cash);
+	if (result == RESULT_OK)
+		sprintf(reply, "[deposit] cash %lld\n", cash);
+	else
+		strcpy(reply, "Not enough cash\n");
+	Rio_writen(fd, reply, strlen(reply));
+}
 
-		V(&(ptr->mutex));             // Release the mutex semaphore
+// Reply "[balance] <account_id> cash <cash> positions <stock_id>:<qty>..."
+void balance(int fd, int account_id)
+{
+	engine_position_t* pos;
+	long long cash;
+	char* reply;
+	int i, n, len;
 
-		inorder(stocks, ptr->right);  // Traverse the right subtree
+	if (account_id == ACCOUNT_NONE)
+	{
+		Rio_writen(fd, "no account\n", strlen("no account\n"));
+		return;
 	}
+	pos = Malloc(sizeof(engine_position_t) * engine_count());
+	engine_balance(account_id, &cash, pos, &n);
+	reply = Malloc(64 + 24 * n);
+	len = sprintf(reply, "[balance] %d cash %lld positions", account_id, cash);
+	for (i = 0; i < n; i++)
+		len += sprintf(reply + len, " %d:%d", pos[i].stock_id, pos[i].qty);
+	reply[len++] = '\n';
+	Rio_writen(fd, reply, len);
+	Free(reply);
+	Free(pos);
 }
 
-void show(int fd)
+typedef struct {
+	char* buf;       // The reply line, fills appended as " <maker order>:<qty>@<price>"
+	int len, cap;
+	int filled;
+} fill_list_t;
+
+void add_fill(void* arg, long long maker_id, int price, int qty)
 {
-	char stocks[MAXLINE];
-	stocks[0] = '\0';
-	inorder(stocks, root);          // Perform inorder traversal of the BST and store the stock information in the 'stocks' string
-	strcat(stocks, "\n");
-	Rio_writen(fd, stocks, strlen(stocks));   // Write the stock information to the specified file descriptor
+	fill_list_t* f = (fill_list_t*)arg;
+
+	if (f->cap - f->len < 64)
+		f->buf = Realloc(f->buf, f->cap = f->cap * 2 + 64);
+	f->len += sprintf(f->buf + f->len, " %lld:%d@%d", maker_id, qty, price);
+	f->filled += qty;
 }
 
-void buy(int fd, int stock_id, int stock_num)
+// Match a bid or ask against the instrument's order book and rest what is left.
+// Fills are collected under the writer lock and the reply written after it.
+void limit_order(int fd, command_t* cmd)
 {
-	STOCK_ITEM* ptr = root;
-	while (ptr)   // Search for the stock_id in the binary search tree
+	fill_list_t f = { NULL, 0, 0, 0 };
+	char head[MAXLINE];
+	long long id;
+	int resting, len, result;
+
+	result = engine_limit(cmd->stock_id, cmd->verb == CMD_BID ? SIDE_BID : SIDE_ASK, cmd->price, cmd->stock_num, &id, &resting, add_fill, &f);
+	if (result != RESULT_OK)
 	{
-		if (ptr->stock_id == stock_id)
-		{
-			break;
-		}
-		else if (stock_id < ptr->stock_id)
-		{
-			ptr = ptr->left;
-		}
+		if (result == RESULT_NO_STOCK)
+			Rio_writen(fd, "stock_id not exists\n", strlen("stock_id not exists\n"));
 		else
-		{
-			ptr = ptr->right;
-		}
+			Rio_writen(fd, "price out of range\n", strlen("price out of range\n"));
+		Free(f.buf);
+		return;
 	}
-	if (ptr == NULL)   // Stock_id does not exist
+	len = sprintf(head, "[%s] filled %d resting %d", cmd->verb == CMD_BID ? "bid" : "ask", f.filled, resting);
+	if (resting > 0)
+		len += sprintf(head + len, " order %lld", id);
+	if (f.len > 0)
+		len += sprintf(head + len, " fills");
+	f.buf = Realloc(f.buf, len + f.len + 1);
+	memmove(f.buf + len, f.buf, f.len);
+	memcpy(f.buf, head, len);
+	f.buf[len + f.len] = '\n';
+	Rio_writen(fd, f.buf, len + f.len + 1);
+	Free(f.buf);
+}
+
+void cancel_order(int fd, int stock_id, long long order_id)
+{
+	char reply[MAXLINE];
+	int qty, result = engine_cancel(stock_id, order_id, &qty);
+
+	if (result == RESULT_NO_STOCK)
+		strcpy(reply, "stock_id not exists\n");
+	else if (result != RESULT_OK)
+		strcpy(reply, "[cancel] no such order\n");
+	else
+		sprintf(reply, "[cancel] success %d\n", qty);
+	Rio_writen(fd, reply, strlen(reply));
+}
+
+// Reply "[book] <id> last <price> bids <price>:<qty>... asks <price>:<qty>..."
+void show_book(int fd, int stock_id)
+{
+	engine_book_t book;
+	char reply[MAXLINE];
+	int side, i, len;
+
+	if (engine_book(stock_id, &book) != RESULT_OK)
 	{
 		Rio_writen(fd, "stock_id not exists\n", strlen("stock_id not exists\n"));
+		return;
 	}
-	else   // Stock_id exists
+	len = sprintf(reply, "[book] %d last %d", stock_id, book.last_price);
+	for (side = SIDE_BID; side <= SIDE_ASK; side++)
 	{
-		P(&(ptr->writer));   // Acquire the writer semaphore to block other writers
+		len += sprintf(reply + len, side == SIDE_BID ? " bids" : " asks");
+		for (i = 0; i < book.n[side]; i++)
+			len += sprintf(reply + len, " %d:%lld", book.prices[side][i], book.qtys[side][i]);
+	}
+	reply[len++] = '\n';
+	Rio_writen(fd, reply, len);
+}
 
-		// Critical Section: Writing
-		if (ptr->left_stock >= stock_num)   // Sufficient stocks are available
-		{
-			ptr->left_stock -= stock_num;
-			Rio_writen(fd, "[buy] success\n", strlen("[buy] success\n"));
-		}
-		else   // Insufficient stocks available
+// Why a command of cost tokens may not run now, or NULL if it may: the reactor
+// serving it is too far behind for it, or its connection or client address
+// is over its rate. A refused command is answered at once with the reason
+// and has no other effect.
+char* refusal(limit_t* l, int cost)
+{
+	if (model != MODEL_THREADPOOL && busy_backlog > 0 && reactor_backlog() >= busy_backlog)
+		return "busy\n";
+	if (!limit_take(l, cost))
+		return "rate limited\n";
+	return NULL;
+}
+
+// Where binary frames come from and go to: a socket, or a shared-memory ring pair
+typedef struct {
+	int fd;                 // Socket; with shm, the text connection that set it up
+	rio_t* rio;             // Buffered reads from fd, unused with shm
+	shm_pair_t* shm;        // Ring pair, NULL for a socket
+	char* shm_name;         // Name of the ring pair until it is unlinked
+	unsigned int conn;      // Connection id in the command log
+	int account_id;         // Account the orders are charged to
+	limit_t* limit;         // Rate limits of the connection
+} frame_io_t;
+
+// Read n bytes of frames. Returns n, or 0 once the client is gone.
+int frame_read(frame_io_t* io, void* buf, int n)
+{
+	if (io->shm)
+	{
+		n = ring_read(io->shm, &io->shm->req, buf, n, io->fd);
+		if (io->shm_name)   // The client has mapped the pair by the time it sends anything
 		{
-			Rio_writen(fd, "Not enough left stocks\n", strlen("Not enough left stocks\n"));
+			shm_unlink(io->shm_name);
+			io->shm_name = NULL;
 		}
-		// End of Critical Section: Writing
+		return n;
+	}
+	return rio_readnb(io->rio, buf, n) == n ? n : 0;   // A reset, like end of file, ends only this client
+}
+
+void frame_write(frame_io_t* io, void* buf, int n)
+{
+	if (io->shm)
+		ring_write(io->shm, &io->shm->resp, buf, n, io->fd);   // A vanished client shows up on the next read
+	else
+		Rio_writen(io->fd, buf, n);
+}
+
+// Send the catalog as BIN_SHOW frames of at most BIN_SHOW_MAX records
+void bin_show(frame_io_t* io)
+{
+	int total = engine_count(), sent = 0, i;
+	engine_stock_t* snap = Malloc(sizeof(engine_stock_t) * (total + 1));
+	bin_stock_t* stocks = Malloc(sizeof(bin_stock_t) * (total + 1));
+	bin_hdr_t hdr;
 
-		V(&(ptr->writer));   // Release the writer semaphore to allow other writers
+	engine_collect(snap);
+	for (i = 0; i < total; i++)
+	{
+		stocks[i].stock_id = htole32(snap[i].stock_id);
+		stocks[i].left_stock = htole32(snap[i].left_stock);
+		stocks[i].stock_price = htole32(snap[i].stock_price);
 	}
+	Free(snap);
+	do
+	{
+		int n = total - sent < BIN_SHOW_MAX ? total - sent : BIN_SHOW_MAX;
+
+		hdr.len = htole16(n * sizeof(bin_stock_t));
+		hdr.type = BIN_SHOW;
+		hdr.status = sent + n < total ? RESULT_MORE : RESULT_OK;
+		frame_write(io, &hdr, sizeof(hdr));
+		frame_write(io, stocks + sent, n * sizeof(bin_stock_t));
+		sent += n;
+	} while (sent < total);
+	Free(stocks);
 }
 
-void sell(int fd, int stock_id, int stock_num)
+// Serve a connection that switched to binary frames until the client leaves
+void serve_binary(frame_io_t* io)
 {
-	STOCK_ITEM* ptr = root;
-	while (ptr)   // Search for the stock_id in the binary search tree
+	bin_hdr_t hdr;
+	bin_order_t order;
+	char skip[MAXBUF];
+
+	while (frame_read(io, &hdr, sizeof(hdr)) == sizeof(hdr))
 	{
-		if (ptr->stock_id == stock_id)
+		int len = le16toh(hdr.len);
+
+		if (!begin_command())
+			return;
+		if ((hdr.type == BIN_BUY || hdr.type == BIN_SELL) && len == sizeof(order))
 		{
-			break;
+			if (frame_read(io, &order, sizeof(order)) != sizeof(order))
+			{
+				end_command();
+				return;
+			}
+			if (cmdlog_on)   // Logged as the text line of the same order
+				cmdlog_record(io->conn, skip, sprintf(skip, "%s %d %d\n", hdr.type == BIN_BUY ? "buy" : "sell",
+					(int)le32toh(order.stock_id), (int)le32toh(order.stock_num)));
+			if (refusal(io->limit, 1))
+				hdr.status = RESULT_BUSY;
+			else if (hdr.type == BIN_BUY)
+				hdr.status = engine_buy(io->account_id, le32toh(order.stock_id), le32toh(order.stock_num));
+			else
+				hdr.status = engine_sell(io->account_id, le32toh(order.stock_id), le32toh(order.stock_num));
+			hdr.len = 0;
+			frame_write(io, &hdr, sizeof(hdr));
 		}
-		else if (stock_id < ptr->stock_id)
+		else if (hdr.type == BIN_SHOW && len == 0)
 		{
-			ptr = ptr->left;
+			if (cmdlog_on)
+				cmdlog_record(io->conn, "show\n", strlen("show\n"));
+			if (refusal(io->limit, 1))
+			{
+				hdr.status = RESULT_BUSY;   // A last, empty show frame
+				frame_write(io, &hdr, sizeof(hdr));
+			}
+			else
+				bin_show(io);
 		}
 		else
 		{
-			ptr = ptr->right;
+			while (len > 0)   // Skip the payload to stay in sync with the framing
+			{
+				int n = len < sizeof(skip) ? len : sizeof(skip);
+
+				if (frame_read(io, skip, n) != n)
+				{
+					end_command();
+					return;
+				}
+				len -= n;
+			}
+			hdr.len = 0;
+			hdr.status = RESULT_INVALID;
+			frame_write(io, &hdr, sizeof(hdr));
 		}
+		end_command();
 	}
-	if (ptr == NULL)   // Stock_id does not exist
+}
+
+void execute_command(int fd, int account_id, command_t* cmd)
+{
+	switch (cmd->verb)
 	{
-		Rio_writen(fd, "stock_id not exists\n", strlen("stock_id not exists\n"));
+	case CMD_SHOW:
+		show(fd);   // Call the "show" function to display the stock information
+		break;
+	case CMD_SINCE:
+		show_since(fd, cmd->since);
+		break;
+	case CMD_BUY:
+		buy(fd, account_id, cmd->stock_id, cmd->stock_num);   // Call the "buy" function to purchase stocks
+		break;
+	case CMD_SELL:
+		sell(fd, account_id, cmd->stock_id, cmd->stock_num);   // Call the "sell" function to sell stocks
+		break;
+	case CMD_BID:
+	case CMD_ASK:
+		limit_order(fd, cmd);
+		break;
+	case CMD_CANCEL:
+		cancel_order(fd, cmd->stock_id, cmd->order_id);
+		break;
+	case CMD_BOOK:
+		show_book(fd, cmd->stock_id);
+		break;
+	case CMD_DEPOSIT:
+		deposit(fd, account_id, cmd->amount);
+		break;
+	case CMD_BALANCE:
+		balance(fd, account_id);
+		break;
+	default:
+		Rio_writen(fd, "invalid command\n", strlen("invalid command\n"));   // Invalid command, send an error message to the client
 	}
-	else   // Stock_id exists
+}
+
+// Register a command as in flight. Returns 0 once shutdown has started, in which
+// case the command must not run. Pairs with the store/load in graceful_shutdown:
+// either shutdown sees this command in inflight, or this command sees draining.
+int begin_command()
+{
+	__atomic_add_fetch(&inflight, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&draining, __ATOMIC_SEQ_CST))
 	{
-		P(&(ptr->writer));   // Acquire the writer semaphore to block other writers
+		__atomic_sub_fetch(&inflight, 1, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+	return 1;
+}
 
-		// Critical Section: Writing
-		ptr->left_stock += stock_num;
-		Rio_writen(fd, "[sell] success\n", strlen("[sell] success\n"));
-		// End of Critical Section: Writing
+void end_command()
+{
+	__atomic_sub_fetch(&inflight, 1, __ATOMIC_SEQ_CST);
+}
 
-		V(&(ptr->writer));   // Release the writer semaphore to allow other writers
-	}
+sem_t checkpoint_req;   // Posted by checkpoint() in the reactor models, consumed by checkpoint_thread
+
+// Write the store back once a client is done. A reactor must not sit through a
+// rewrite and its fsync with all of its connections waiting, so there the write
+// is left to checkpoint_thread.
+void checkpoint()
+{
+	if (model == MODEL_THREADPOOL)
+		engine_checkpoint();
+	else
+		V(&checkpoint_req);
 }
 
-void load_stock_to_memory()
+void* checkpoint_thread(void* vargp)
 {
-	FILE* fp = fopen("stock.txt", "r");   // Open the file "stock.txt" in read mode
-	int res;
-	int stock_id;
-	int left_stock;
-	int stock_price;
+	Pthread_detach(pthread_self());
+
 	while (1)
 	{
-		res = fscanf(fp, "%d %d %d", &stock_id, &left_stock, &stock_price);
-		if (res == EOF)
-			break;
-		stock_add_to_list(stock_id, left_stock, stock_price);   // Add the stock information to the temporary list
+		P(&checkpoint_req);
+		while (sem_trywait(&checkpoint_req) == 0)
+			;   // Clients that left during the last write are all covered by the next one
+		if (!begin_command())   // Shutting down: engine_flush() writes the final state
+			continue;
+		engine_checkpoint();
+		end_command();
 	}
-	stock_list_to_bst();   // Convert the temporary list to a binary search tree (BST)
-	fclose(fp);   // Close the file
+	return NULL;
 }
 
+#define TAG_INFLIGHT 8    // Tagged shows of one connection running at once
+#define READY_LINES  64   // Lines a reactor reads from one connection per round
 
-void inorder_print(STOCK_ITEM* ptr, FILE* fp)
-{
-	if (ptr)
-	{
-		inorder_print(ptr->left, fp);
+#define CONN_OPEN   0     // Keep reading commands
+#define CONN_CLOSE  1     // The client left, said exit or was turned away
+#define CONN_BINARY 2     // The client switched to binary frames
 
-		P(&(ptr->mutex));
-		ptr->stock_readcnt++;
-		if (ptr->stock_readcnt == 1)   // First reader
-			P(&(ptr->writer));
-		V(&(ptr->mutex));
-		// Critical Section: Reading
+typedef struct {
+	int fd;
+	rio_t rio;
+	watch_t* w;             // Created by the connection's first watch command
+	sem_t reply_mutex;      // Held while a reply is written, so replies never interleave
+	sem_t slots;            // Free places for tagged shows running on their own thread
+	unsigned int id;        // Connection id in the command log, 0 when not recording
+	int account_id;         // Account the connection's orders are charged to, ACCOUNT_NONE until it picks one
+	limit_t limit;          // Its rate limits
+	char* refused;          // Why the batch or multi-leg order being read is not run, NULL to run it
+	int state;              // CONN_*, what the last line read left the connection in
+	command_t head;         // Batch or multi-leg order whose lines are being read
+	int want, have;         // Its lines in all and so far, want is 0 between commands
+	engine_order_t* orders; // Its orders, allocated by the connection's first batch
+	shm_pair_t* shm;        // Ring pair set up by a shm command
+	char shm_name[64];
+} conn_t;
 
-		fprintf(fp, "%d %d %d\n", ptr->stock_id, ptr->left_stock, ptr->stock_price);   // Write the stock information to the file
+typedef struct {
+	conn_t* c;
+	command_t cmd;
+} tagged_job_t;
 
-		// End of Critical Section: Reading
+conn_t* conn_new(int fd)
+{
+	conn_t* c = Calloc(1, sizeof(conn_t));
+
+	c->fd = fd;
+	Rio_readinitb(&c->rio, fd);   // Once per connection, so pipelined commands are not dropped
+	c->id = cmdlog_on ? cmdlog_conn() : 0;
+	Sem_init(&c->reply_mutex, 0, 1);
+	Sem_init(&c->slots, 0, TAG_INFLIGHT);
+	limit_open(&c->limit, fd);
+	return c;
+}
 
-		P(&(ptr->mutex));
-		ptr->stock_readcnt--;
-		if (ptr->stock_readcnt == 0)   // Last reader
-			V(&(ptr->writer));
-		V(&(ptr->mutex));
+// Take the connection's socket for one reply, and start it with the request
+// tag if the command had one. No watch update is written while it is held.
+void reply_lock(conn_t* c, command_t* cmd)
+{
+	char tag[32];
 
-		inorder_print(ptr->right, fp);
-	}
+	P(&c->reply_mutex);
+	if (c->w)
+		watch_lock(c->w);
+	if (cmd->tagged)
+		Rio_writen(c->fd, tag, sprintf(tag, "#%lld ", cmd->tag));
 }
 
-void update_file()
+void reply_unlock(conn_t* c)
 {
-	P(&file_mutex);   // Acquire the file_mutex semaphore to ensure exclusive access to the file
-	// FILE WRITE, Critical Section
-	FILE* fp = fopen("stock.txt", "w");   // Open the file "stock.txt" in write mode
-	inorder_print(root, fp);   // Perform an inorder traversal of the BST and write the stock information to the file
-	fclose(fp);   // Close the file
-	// End of FILE WRITE, Critical Section
-	V(&file_mutex);   // Release the file_mutex semaphore
+	if (c->w)
+		watch_unlock(c->w);
+	V(&c->reply_mutex);
 }
 
-void execute_command(int fd, char* command)
+// Run a tagged show off the connection's worker, so the orders after it are
+// answered while it is rendered; its reply goes out whenever it is ready.
+void* tagged_thread(void* vargp)
 {
-	char order[MAXLINE];   // Command
-	int stock_id;   // Stock ID (as an integer)
-	int stock_num;   // Stock quantity
+	tagged_job_t* job = (tagged_job_t*)vargp;
+	conn_t* c = job->c;
+	show_buf_t* b = NULL;
+	char* buf;
+	int len;
 
-	sscanf(command, "%s %d %d", order, &stock_id, &stock_num);   // Parse the command string
+	Pthread_detach(pthread_self());
+	if (job->cmd.verb == CMD_SHOW)
+	{
+		b = show_acquire();
+		buf = b->data;
+		len = b->len;
+	}
+	else
+	{
+		buf = Malloc(engine_show_max());
+		len = engine_since(job->cmd.since, buf);
+	}
 
-	if (!strcmp(order, "show"))
+	reply_lock(c, &job->cmd);
+	Rio_writen(c->fd, buf, len);
+	reply_unlock(c);
+
+	if (b)
+		show_release(b);
+	else
+		Free(buf);
+	Free(job);
+	end_command();
+	V(&c->slots);   // Last: the connection may be dropped as soon as every slot is back
+	return NULL;
+}
+
+// Serve one line read from c: a command, or an order line of the batch or
+// multi-leg order in c->head. Never reads from the client itself, so one
+// reactor thread can serve many connections with it. Returns CONN_*.
+int serve_line(conn_t* c, char* line, int n)
+{
+	command_t cmd;
+	char* refused;
+	int i;
+
+	if (c->want > 0)
 	{
-		show(fd);   // Call the "show" function to display the stock information
+		if (cmdlog_on)
+			cmdlog_record(c->id, line, n);
+		parse_order(line, n, &c->orders[c->have++]);
+		if (c->have < c->want)
+			return CONN_OPEN;
+		reply_lock(c, &c->head);
+		if (c->refused)
+			Rio_writen(c->fd, c->refused, strlen(c->refused));
+		else if (c->head.verb == CMD_BATCH)
+			batch(c->fd, c->account_id, c->orders, c->want);
+		else
+			multi(c->fd, c->account_id, c->orders, c->want);
+		reply_unlock(c);
+		c->want = 0;
+		end_command();
+		return CONN_OPEN;
+	}
+
+	// Command received
+	printf("server received %d bytes\n", n);
+
+	if (!begin_command())
+	{
+		P(&c->reply_mutex);
+		Rio_writen(c->fd, "server shutting down\n", strlen("server shutting down\n"));
+		V(&c->reply_mutex);
+		return CONN_CLOSE;
+	}
+	parse_command(line, n, &cmd);
+	if (cmdlog_on && cmd.verb != CMD_BINARY && cmd.verb != CMD_SHM)   // Frames that follow are logged as text
+		cmdlog_record(c->id, line, n);
+	refused = cmd.verb == CMD_EXIT || cmd.verb == CMD_EMPTY ? NULL :
+		refusal(&c->limit, cmd.verb == CMD_BATCH || cmd.verb == CMD_MULTI ? cmd.count : 1);
+	if (refused && cmd.verb != CMD_BATCH && cmd.verb != CMD_MULTI)   // Their lines are still read, see below
+	{
+		reply_lock(c, &cmd);
+		Rio_writen(c->fd, refused, strlen(refused));
+		reply_unlock(c);
+		end_command();
+		return CONN_OPEN;
+	}
+	if (cmd.tagged && (cmd.verb == CMD_SHOW || cmd.verb == CMD_SINCE))
+	{
+		tagged_job_t* job = Malloc(sizeof(tagged_job_t));
+		pthread_t tid;
+
+		job->c = c;
+		job->cmd = cmd;
+		P(&c->slots);
+		Pthread_create(&tid, NULL, tagged_thread, job);   // It ends the command
+		return CONN_OPEN;
+	}
+	if (cmd.verb == CMD_BATCH || cmd.verb == CMD_MULTI)
+	{
+		if (c->orders == NULL)
+			c->orders = Malloc(sizeof(engine_order_t) * BATCH_MAX);
+		c->head = cmd;
+		c->want = cmd.count;
+		c->have = 0;
+		c->refused = refused;
+		return CONN_OPEN;   // Executed and ended with its last line
 	}
-	else if (!strcmp(order, "buy"))
+	if (cmd.verb == CMD_BINARY || cmd.verb == CMD_SHM)
 	{
-		buy(fd, stock_id, stock_num);   // Call the "buy" function to purchase stocks
+		char reply[96];
+
+		for (i = 0; i < TAG_INFLIGHT; i++)   // Nothing tagged may be written into the frames
+			P(&c->slots);
+		for (i = 0; i < TAG_INFLIGHT; i++)
+			V(&c->slots);
+		if (cmd.verb == CMD_SHM && (c->shm = shm_pair_create(c->shm_name)) == NULL)
+		{
+			reply_lock(c, &cmd);   // Out of shared memory: the client stays on text
+			Rio_writen(c->fd, "shm unavailable\n", strlen("shm unavailable\n"));
+			reply_unlock(c);
+			end_command();
+			return CONN_OPEN;
+		}
+		reply_lock(c, &cmd);
+		if (c->w)   // Updates are text lines, they end with the text protocol
+		{
+			watch_unlock(c->w);
+			watch_close(c->w);
+			c->w = NULL;
+		}
+		if (cmd.verb == CMD_SHM)
+			Rio_writen(c->fd, reply, sprintf(reply, SHM_HELLO_OK "%s\n", c->shm_name));
+		else
+			Rio_writen(c->fd, BIN_HELLO_OK, strlen(BIN_HELLO_OK));
+		reply_unlock(c);
+		end_command();
+		return CONN_BINARY;
 	}
-	else if (!strcmp(order, "sell"))
+
+	reply_lock(c, &cmd);
+	if (cmd.verb == CMD_EXIT)
 	{
-		sell(fd, stock_id, stock_num);   // Call the "sell" function to sell stocks
+		checkpoint();
+		Rio_writen(c->fd, "exit\n", strlen("exit\n"));
+		reply_unlock(c);
+		end_command();
+		return CONN_CLOSE;
+	}
+	else if (cmd.verb == CMD_WATCH)
+	{
+		if (c->w == NULL)
+		{
+			c->w = watch_new(c->fd);
+			watch_lock(c->w);
+		}
+		watch(c->fd, c->w, &cmd);
+	}
+	else if (cmd.verb == CMD_UNWATCH)
+	{
+		if (c->w)
+		{
+			watch_unlock(c->w);
+			watch_close(c->w);
+			c->w = NULL;
+		}
+		Rio_writen(c->fd, "[unwatch] success\n", strlen("[unwatch] success\n"));
+	}
+	else if (cmd.verb == CMD_ACCOUNT)
+	{
+		char reply[64];
+
+		if (engine_account(cmd.account_id) == RESULT_OK)
+		{
+			c->account_id = cmd.account_id;
+			Rio_writen(c->fd, reply, sprintf(reply, "[account] %d\n", c->account_id));
+		}
+		else   // Only with --durability=memory
+			Rio_writen(c->fd, "accounts unavailable\n", strlen("accounts unavailable\n"));
+	}
+	else if (cmd.verb == CMD_EMPTY)
+	{
+		Rio_writen(c->fd, "\n", strlen("\n"));
 	}
 	else
+		execute_command(c->fd, c->account_id, &cmd);
+	reply_unlock(c);
+	end_command();
+	return CONN_OPEN;
+}
+
+// Finish a connection that serve_line() or the client ended: serve its
+// frames first if it switched to them, then close it and free c.
+void conn_end(conn_t* c)
+{
+	int i;
+
+	if (c->state == CONN_BINARY)
 	{
-		Rio_writen(fd, "invalid command\n", strlen("invalid command\n"));   // Invalid command, send an error message to the client
+		frame_io_t io = { c->fd, &c->rio, c->shm, c->shm ? c->shm_name : NULL, c->id, c->account_id, &c->limit };
+
+		serve_binary(&io);
+		if (io.shm_name)   // The client never sent a frame
+			shm_unlink(io.shm_name);
+		if (io.shm)
+			shm_pair_close(io.shm);
+		engine_checkpoint();
 	}
+	if (c->want > 0)   // Client closed connection inside the batch or multi-leg order
+		end_command();
+	for (i = 0; i < TAG_INFLIGHT; i++)   // Wait for the tagged shows still writing to c
+		P(&c->slots);
+	if (c->w)   // Before Close, so the publisher never writes to a reused descriptor
+		watch_close(c->w);
+	if (cmdlog_on)
+		cmdlog_record(c->id, NULL, 0);
+	Close(c->fd);
+	if (c->orders)
+		Free(c->orders);
+	Free(c);
 }
 
 void* thread(void* vargp)
 {
+	char* line;
+	conn_t* c;
 	int n;
-	rio_t rio;
-	char command[MAXLINE];
 	Pthread_detach(pthread_self());
 
 	while (1)
 	{
-		int connfd = sbuf_remove(&sbuf);
-
-		while (1)
+		c = conn_new(sbuf_remove(&sbuf));
+		do
 		{
-			int i;
-			for (i = 0; i < MAXLINE; i++)
-				command[i] = '\0';
-
-			Rio_readinitb(&rio, connfd);
-			if ((n = Rio_readlineb(&rio, command, MAXLINE)) != 0)
-			{
-				// Command received
-				printf("server received %d bytes\n", n);
-
-				if (!strcmp(command, "exit\n"))
-				{
-					update_file();
-					Rio_writen(connfd, "exit\n", strlen("exit\n"));
-					Close(connfd);
-					break;
-				}
-				else if (!strcmp(command, "\n"))
-				{
-					Rio_writen(connfd, "\n", strlen("\n"));
-				}
-				else
-					execute_command(connfd, command);
-			}
+			if ((n = rio_readline_inplace(&c->rio, &line)) > 0)
+				c->state = serve_line(c, line, n);
 			else
 			{
-				// Client closed connection
-				update_file();
-				Close(connfd);
-				break;
+				// Client closed connection (or it failed)
+				engine_checkpoint();
+				c->state = CONN_CLOSE;
 			}
+		} while (c->state == CONN_OPEN);
+		conn_end(c);
+	}
+}
+
+// A reactor saw input on the connection: serve the whole lines it has sent.
+// After READY_LINES of them only those already buffered are served, and the
+// rest of the socket waits for the next round, so a client that keeps sending
+// cannot keep the reactor from its other connections.
+// Not everything here is free of waiting yet: replies go out with blocking
+// writes, so a client that stops reading holds up the reactor once its socket
+// buffer is full, and a tagged show waits on the reactor for one of the
+// connection's TAG_INFLIGHT slots. Checkpoints go to checkpoint_thread.
+int conn_ready(void* vargp)
+{
+	conn_t* c = (conn_t*)vargp;
+	char* line;
+	int n, lines = 0;
+
+	while ((lines++ < READY_LINES || rio_has_line(&c->rio)) && (n = rio_readline_nowait(&c->rio, &line)) > 0)
+		if ((c->state = serve_line(c, line, n)) != CONN_OPEN)
+			return REACTOR_DROP;
+	if (lines > READY_LINES)   // Still readable, the reactor comes back to it
+		return REACTOR_KEEP;
+	if (n < 0 && errno == EAGAIN)
+		return REACTOR_KEEP;
+	// Client closed connection (or it failed)
+	checkpoint();
+	c->state = CONN_CLOSE;
+	return REACTOR_DROP;
+}
+
+// Frames are read with blocking calls, so a binary session leaves the reactor
+// for a thread of its own
+void* binary_thread(void* vargp)
+{
+	Pthread_detach(pthread_self());
+	conn_end((conn_t*)vargp);
+	return NULL;
+}
+
+void conn_done(void* vargp)
+{
+	conn_t* c = (conn_t*)vargp;
+	pthread_t tid;
+
+	if (c->state == CONN_BINARY)
+		Pthread_create(&tid, NULL, binary_thread, c);
+	else
+		conn_end(c);
+}
+
+// Hand a new connection to the worker pool or to a reactor
+void dispatch(int connfd)
+{
+	conn_t* c;
+
+	if (model == MODEL_THREADPOOL)
+	{
+		if (busy_queue > 0 && sbuf_count(&sbuf) >= busy_queue)   // Turned away at once instead of waiting for a worker
+		{
+			send(connfd, "busy\n", strlen("busy\n"), MSG_NOSIGNAL);
+			Close(connfd);
+			return;
 		}
+		sbuf_insert(&sbuf, connfd);
+		return;
+	}
+	c = conn_new(connfd);
+	if (reactor_add(connfd, c) < 0)
+	{
+		fprintf(stderr, "descriptor %d is past what the reactor can watch\n", connfd);
+		c->state = CONN_CLOSE;
+		conn_end(c);
 	}
 }
 
 
+// Listen on an AF_UNIX stream socket at path, replacing a stale one
+int open_unix_listenfd(char* path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		app_error("--unix path too long");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	fd = Socket(AF_UNIX, SOCK_STREAM, 0);
+	Bind(fd, (SA*)&addr, sizeof(addr));
+	Listen(fd, LISTENQ);
+	return fd;
+}
+
+// Stop accepting, give in-flight commands up to drain_ms to finish, flush once and exit
+void graceful_shutdown(int listenfd)
+{
+	struct timeval start, now;
+	long waited_ms = 0;
+	int left;
+
+	Close(listenfd);
+	if (unix_listenfd >= 0)
+	{
+		Close(unix_listenfd);
+		unlink(unix_path);
+	}
+	__atomic_store_n(&draining, 1, __ATOMIC_SEQ_CST);
+	gettimeofday(&start, NULL);
+	while ((left = __atomic_load_n(&inflight, __ATOMIC_SEQ_CST)) > 0 && waited_ms < drain_ms)
+	{
+		usleep(1000);
+		gettimeofday(&now, NULL);
+		waited_ms = (now.tv_sec - start.tv_sec) * 1000L + (now.tv_usec - start.tv_usec) / 1000;
+	}
+
+	if (cmdlog_on)
+		cmdlog_close();
+	engine_flush();
+	printf("[shutdown] drained in %ld ms, %d commands cut off, state flushed\n", waited_ms, left);
+
+	// Workers, reactors and the checkpoint thread still run and may be inside
+	// the engine or the buffer, so leave freeing them to exit()
+	exit(0);
+}
+
 int main(int argc, char** argv)
 {
 	int i, listenfd, connfd;
@@ -426,31 +1112,164 @@ int main(int argc, char** argv)
 	char client_hostname[MAXLINE], client_port[MAXLINE];
 
 	pthread_t tid;
+	sigset_t mask;
+	int sigfd;
+	struct signalfd_siginfo si;
+	struct pollfd pfds[3];
 
-	if (argc != 2)
+	if (argc < 2)
 	{
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
+		fprintf(stderr, "usage: %s <port> [--persist=rewrite|fork|pwrite] [--durability=memory|async|group|sync] [--group-ms=N] [--group-orders=M] [--compact-bytes=N] [--drain-ms=N] [--unix=PATH] [--engine=locked|sequencer] [--shards=N] [--record=PATH] [--model=select|epoll|threadpool|multireactor|uring] [--reactors=N] [--accounts=PATH] [--combine-ns=N] [--net-us=N] [--rate=N] [--ip-rate=N] [--burst=N] [--busy-queue=N] [--busy-backlog=N]\n"
+			"  --busy-backlog is at most 255 with epoll and multireactor, 1019 with select and 2047 with uring; 1024 or that most by default\n", argv[0]);
 		exit(0);
 	}
+	for (i = 2; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--persist=fork"))
+			config.persist = PERSIST_FORK;
+		else if (!strcmp(argv[i], "--persist=pwrite"))
+			config.persist = PERSIST_PWRITE;
+		else if (!strcmp(argv[i], "--persist=rewrite"))
+			config.persist = PERSIST_REWRITE;
+		else if (!strcmp(argv[i], "--durability=memory"))
+			config.durability = DURABILITY_MEMORY;
+		else if (!strcmp(argv[i], "--durability=async"))
+			config.durability = DURABILITY_ASYNC;
+		else if (!strcmp(argv[i], "--durability=group"))
+			config.durability = DURABILITY_GROUP;
+		else if (!strcmp(argv[i], "--durability=sync"))
+			config.durability = DURABILITY_SYNC;
+		else if (!strncmp(argv[i], "--group-ms=", 11))
+			group_ms = atoi(argv[i] + 11);
+		else if (!strncmp(argv[i], "--group-orders=", 15))
+			group_orders = atoi(argv[i] + 15);
+		else if (!strncmp(argv[i], "--compact-bytes=", 16))
+			compact_bytes = atol(argv[i] + 16);
+		else if (!strncmp(argv[i], "--drain-ms=", 11))
+			drain_ms = atoi(argv[i] + 11);
+		else if (!strncmp(argv[i], "--unix=", 7))
+			unix_path = argv[i] + 7;
+		else if (!strncmp(argv[i], "--accounts=", 11))
+			config.accounts = argv[i] + 11;
+		else if (!strncmp(argv[i], "--combine-ns=", 13))
+			config.combine_ns = atoi(argv[i] + 13);
+		else if (!strncmp(argv[i], "--net-us=", 9) && atoi(argv[i] + 9) >= 0)
+			config.net_us = atoi(argv[i] + 9);
+		else if (!strncmp(argv[i], "--rate=", 7) && atoi(argv[i] + 7) >= 0)
+			conn_rate = atoi(argv[i] + 7);
+		else if (!strncmp(argv[i], "--ip-rate=", 10) && atoi(argv[i] + 10) >= 0)
+			ip_rate = atoi(argv[i] + 10);
+		else if (!strncmp(argv[i], "--burst=", 8) && atoi(argv[i] + 8) >= 1)
+			burst = atoi(argv[i] + 8);
+		else if (!strncmp(argv[i], "--busy-queue=", 13) && atoi(argv[i] + 13) >= 0 && atoi(argv[i] + 13) <= SBUFSIZE)
+			busy_queue = atoi(argv[i] + 13);
+		else if (!strncmp(argv[i], "--busy-backlog=", 15) && atoi(argv[i] + 15) >= 0)
+			busy_backlog = atoi(argv[i] + 15);
+		else if (!strncmp(argv[i], "--record=", 9))
+			record_path = argv[i] + 9;
+		else if (!strcmp(argv[i], "--engine=locked"))
+			config.mode = ENGINE_LOCKED;
+		else if (!strcmp(argv[i], "--engine=sequencer"))
+			config.mode = ENGINE_SEQUENCER;
+		else if (!strcmp(argv[i], "--model=select"))
+			model = MODEL_SELECT;
+		else if (!strcmp(argv[i], "--model=epoll"))
+			model = MODEL_EPOLL;
+		else if (!strcmp(argv[i], "--model=threadpool"))
+			model = MODEL_THREADPOOL;
+		else if (!strcmp(argv[i], "--model=multireactor"))
+			model = MODEL_MULTIREACTOR;
+		else if (!strcmp(argv[i], "--model=uring"))
+			model = MODEL_URING;
+		else if (!strncmp(argv[i], "--reactors=", 11) && atoi(argv[i] + 11) >= 1)
+			nreactors = atoi(argv[i] + 11);
+		else if (!strncmp(argv[i], "--shards=", 9) && atoi(argv[i] + 9) >= 1 && atoi(argv[i] + 9) <= SHARDS_MAX)
+			config.shards = atoi(argv[i] + 9);
+		else
+		{
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			exit(0);
+		}
+	}
+
+	// SIGINT and SIGTERM are read from sigfd by the accept loop instead of interrupting
+	// whatever thread happens to run. Blocked here, before any thread is created, so
+	// every thread inherits the mask.
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGINT);
+	Sigaddset(&mask, SIGTERM);
+	Sigprocmask(SIG_BLOCK, &mask, NULL);
+	if ((sigfd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0)
+		unix_error("signalfd error");
+	Signal(SIGPIPE, SIG_IGN);   // A client that leaves mid-reply only fails that write
 
 	// Load stock to memory
-	Signal(SIGINT, sig_int_handler);
-	load_stock_to_memory();
-	Sem_init(&file_mutex, 0, 1);
+	engine_open(&config);
+	watch_init(engine_count(), format_update);
+	limit_init(conn_rate, ip_rate, burst);
+	if (record_path)
+		cmdlog_open(record_path);
 
 	listenfd = Open_listenfd(argv[1]);
-	sbuf_init(&sbuf, SBUFSIZE);
+	if (unix_path)
+		unix_listenfd = open_unix_listenfd(unix_path);
+	if (model == MODEL_THREADPOOL)
+	{
+		sbuf_init(&sbuf, SBUFSIZE);
+		for (i = 0; i < SBUFSIZE; i++)
+			Pthread_create(&tid, NULL, thread, NULL);
+	}
+	else
+	{
+		Sem_init(&checkpoint_req, 0, 0);
+		Pthread_create(&tid, NULL, checkpoint_thread, NULL);
+		reactor_start(model, model == MODEL_MULTIREACTOR ? (nreactors ? nreactors : sysconf(_SC_NPROCESSORS_ONLN)) : 1, conn_ready, conn_done);
+		if (busy_backlog > reactor_backlog_max())
+		{
+			fprintf(stderr, "--busy-backlog=%d can never trip: this model sees at most %d ready connections behind the one served\n",
+				busy_backlog, reactor_backlog_max());
+			exit(0);
+		}
+		if (busy_backlog < 0)
+			busy_backlog = BUSY_BACKLOG < reactor_backlog_max() ? BUSY_BACKLOG : reactor_backlog_max();
+	}
 
-	for (i = 0; i < SBUFSIZE; i++)
-		Pthread_create(&tid, NULL, thread, NULL);
+	pfds[0].fd = listenfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = sigfd;
+	pfds[1].events = POLLIN;
+	pfds[2].fd = unix_listenfd;   // poll skips it while -1
+	pfds[2].events = POLLIN;
 
 	while (1)
 	{
-		clientlen = sizeof(struct sockaddr_storage);
-		connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
-		Getnameinfo((SA*)&clientaddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE, 0);
-		printf("Connected to (%s, %s)\n", client_hostname, client_port);
-		sbuf_insert(&sbuf, connfd);
+		if (poll(pfds, 3, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			unix_error("poll error");
+		}
+		if (pfds[1].revents & POLLIN)
+		{
+			if (read(sigfd, &si, sizeof(si)) == sizeof(si))
+				printf("[shutdown] caught signal %d\n", (int)si.ssi_signo);
+			graceful_shutdown(listenfd);
+		}
+		if (pfds[0].revents & POLLIN)
+		{
+			clientlen = sizeof(struct sockaddr_storage);
+			connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
+			Getnameinfo((SA*)&clientaddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE, 0);
+			printf("Connected to (%s, %s)\n", client_hostname, client_port);
+			dispatch(connfd);
+		}
+		if (pfds[2].revents & POLLIN)
+		{
+			connfd = Accept(unix_listenfd, NULL, NULL);
+			printf("Connected to (unix, %s)\n", unix_path);
+			dispatch(connfd);
+		}
 	}
 }
 /* $end echoserverimain */
+
@@ -0,0 +1,310 @@
+/*
+ * watch.c - push updates of changed instruments to subscribed connections
+ *
+ * The order path only sets the instrument's bit in the changed map and wakes
+ * the publisher. The publisher thread then, once per round, formats each
+ * changed instrument once and queues the line on every subscriber of that
+ * instrument, and sends what it queued with non-blocking writes. However many
+ * watchers an instrument has, the order that changed it never waits for them.
+ *
+ * A subscriber whose socket does not take its updates stops getting lines
+ * queued; its changed instruments are remembered in a per-subscriber bitmap
+ * instead and sent with their latest value once it catches up, so a lagging
+ * watcher costs one bit per instrument rather than a growing queue.
+ */
+#include "watch.h"
+
+typedef struct {
+	watch_t** subs;
+	int n, cap;
+} watch_list_t;
+
+static int nwords;                  // Words of a bitmap over stock_idx
+static watch_format_t* format;
+static unsigned long* changed;      // Set by watch_changed, swapped out by the publisher
+static int kicked = 0;              // The publisher has been woken for the current round
+static int watchers = 0;            // Open subscriptions; the order path does nothing while 0
+static sem_t watch_req;             // Wakes the publisher
+
+// Subscription lists; the publisher holds watch_mutex for a whole round
+static pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static watch_list_t* by_idx;        // Subscribers of each instrument
+static watch_list_t all_list;       // Subscribers of every instrument
+static watch_list_t backlog;        // Subscribers with something left to send
+
+static void list_add(watch_list_t* l, watch_t* w)
+{
+	if (l->n == l->cap)
+		l->subs = Realloc(l->subs, sizeof(watch_t*) * (l->cap = l->cap ? l->cap * 2 : 4));
+	l->subs[l->n++] = w;
+}
+
+static void list_remove(watch_list_t* l, watch_t* w)
+{
+	int i;
+
+	for (i = 0; i < l->n; i++)
+		if (l->subs[i] == w)
+		{
+			l->subs[i] = l->subs[--l->n];
+			return;
+		}
+}
+
+// Queue one update on w, or remember the instrument if w is lagging or busy
+static void deliver(watch_t* w, int idx, const char* line, int len)
+{
+	int queued = 0;
+
+	if (w->dead)
+		return;
+	if (w->pending == NULL && sem_trywait(&w->mutex) == 0)
+	{
+		if ((queued = w->out_len + len <= WATCH_BUF))
+		{
+			memcpy(w->out + w->out_len, line, len);
+			w->out_len += len;
+		}
+		V(&w->mutex);
+	}
+	if (!queued)
+	{
+		if (w->pending == NULL)
+			w->pending = Calloc(nwords, sizeof(unsigned long));
+		w->pending[idx / 64] |= 1UL << (idx % 64);   // Coalesced: sent later with its latest value
+	}
+	if (!w->backlog)
+	{
+		w->backlog = 1;
+		list_add(&backlog, w);
+	}
+}
+
+// Move pending instruments into out while they fit
+static void refill(watch_t* w)
+{
+	char line[MAXLINE];
+	int i, len, left = 0;
+
+	for (i = 0; i < nwords; i++)
+	{
+		unsigned long bits = w->pending[i];
+
+		while (bits)
+		{
+			int idx = i * 64 + __builtin_ctzl(bits);
+
+			len = format(idx, line);
+			if (w->out_len + len > WATCH_BUF)
+				break;
+			memcpy(w->out + w->out_len, line, len);
+			w->out_len += len;
+			bits &= bits - 1;
+		}
+		w->pending[i] = bits;
+		left |= bits != 0;
+	}
+	if (!left)
+	{
+		Free(w->pending);
+		w->pending = NULL;
+	}
+}
+
+// Send what the socket takes without blocking. Returns 1 once nothing is left.
+// A subscriber whose worker is answering a command is retried next round.
+static int flush(watch_t* w)
+{
+	ssize_t n;
+	int done;
+
+	if (w->dead)
+		return 1;
+	if (sem_trywait(&w->mutex) < 0)
+		return 0;
+	while (1)
+	{
+		if (w->out_off < w->out_len)
+		{
+			if ((n = send(w->fd, w->out + w->out_off, w->out_len - w->out_off, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0)
+			{
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					w->dead = 1;   // The worker sees the connection fail on its next read or write
+				break;
+			}
+			w->out_off += n;
+			continue;
+		}
+		w->out_off = w->out_len = 0;
+		if (w->pending == NULL)
+			break;
+		refill(w);
+	}
+	done = w->dead || (w->out_off == w->out_len && w->pending == NULL);
+	V(&w->mutex);
+	return done;
+}
+
+static void* publisher(void* vargp)
+{
+	char line[MAXLINE];
+	int i, j, len;
+
+	Pthread_detach(pthread_self());
+	while (1)
+	{
+		if (backlog.n == 0)
+			P(&watch_req);
+		else
+			usleep(1000);   // Lagging subscribers: poll their sockets until they drain
+		__atomic_store_n(&kicked, 0, __ATOMIC_SEQ_CST);
+
+		pthread_mutex_lock(&watch_mutex);
+		for (i = 0; i < nwords; i++)
+		{
+			unsigned long bits = 0;
+
+			if (__atomic_load_n(&changed[i], __ATOMIC_RELAXED))
+				bits = __atomic_exchange_n(&changed[i], 0, __ATOMIC_ACQUIRE);
+
+			while (bits)
+			{
+				int idx = i * 64 + __builtin_ctzl(bits);
+				watch_list_t* l = &by_idx[idx];
+
+				len = format(idx, line);   // Once per instrument, however many watch it
+				for (j = 0; j < l->n; j++)
+					deliver(l->subs[j], idx, line, len);
+				for (j = 0; j < all_list.n; j++)
+					deliver(all_list.subs[j], idx, line, len);
+				bits &= bits - 1;
+			}
+		}
+		for (j = 0; j < backlog.n; j++)
+		{
+			if (flush(backlog.subs[j]))
+			{
+				backlog.subs[j]->backlog = 0;
+				backlog.subs[j--] = backlog.subs[--backlog.n];
+			}
+		}
+		pthread_mutex_unlock(&watch_mutex);
+	}
+	return NULL;
+}
+
+// Start the publisher for n instruments, stock_idx 0 to n - 1
+void watch_init(int n, watch_format_t* fmt)
+{
+	pthread_t tid;
+
+	nwords = (n + 63) / 64;
+	format = fmt;
+	changed = Calloc(nwords, sizeof(unsigned long));
+	by_idx = Calloc(n > 0 ? n : 1, sizeof(watch_list_t));
+	Sem_init(&watch_req, 0, 0);
+	Pthread_create(&tid, NULL, publisher, NULL);
+}
+
+// Called by the order path after an instrument changed. Without subscribers it
+// is one load; otherwise one atomic OR, plus a wakeup once per round.
+void watch_changed(int idx)
+{
+	if (__atomic_load_n(&watchers, __ATOMIC_RELAXED) == 0)
+		return;
+	__atomic_fetch_or(&changed[idx / 64], 1UL << (idx % 64), __ATOMIC_RELEASE);
+	if (!__atomic_exchange_n(&kicked, 1, __ATOMIC_SEQ_CST))
+		V(&watch_req);
+}
+
+watch_t* watch_new(int fd)
+{
+	watch_t* w = Calloc(1, sizeof(watch_t));
+
+	w->fd = fd;
+	Sem_init(&w->mutex, 0, 1);
+	w->out = Malloc(WATCH_BUF);
+	pthread_mutex_lock(&watch_mutex);
+	watchers++;
+	pthread_mutex_unlock(&watch_mutex);
+	return w;
+}
+
+// Subscribe w to the instrument at stock_idx; subscribing twice is a no-op
+void watch_add(watch_t* w, int idx)
+{
+	int i;
+
+	pthread_mutex_lock(&watch_mutex);
+	for (i = 0; i < w->nidxs && w->idxs[i] != idx; i++)
+		;
+	if (i == w->nidxs && !w->all)
+	{
+		if (w->nidxs == w->cap)
+			w->idxs = Realloc(w->idxs, sizeof(int) * (w->cap = w->cap ? w->cap * 2 : 4));
+		w->idxs[w->nidxs++] = idx;
+		list_add(&by_idx[idx], w);
+	}
+	pthread_mutex_unlock(&watch_mutex);
+}
+
+// Subscribe w to every instrument, replacing its single subscriptions
+void watch_add_all(watch_t* w)
+{
+	int i;
+
+	pthread_mutex_lock(&watch_mutex);
+	for (i = 0; i < w->nidxs; i++)
+		list_remove(&by_idx[w->idxs[i]], w);
+	w->nidxs = 0;
+	if (!w->all)
+	{
+		w->all = 1;
+		list_add(&all_list, w);
+	}
+	pthread_mutex_unlock(&watch_mutex);
+}
+
+// Drop every subscription of w and free it. Call before its connection is closed.
+void watch_close(watch_t* w)
+{
+	int i;
+
+	pthread_mutex_lock(&watch_mutex);
+	for (i = 0; i < w->nidxs; i++)
+		list_remove(&by_idx[w->idxs[i]], w);
+	if (w->all)
+		list_remove(&all_list, w);
+	if (w->backlog)
+		list_remove(&backlog, w);
+	watchers--;
+	pthread_mutex_unlock(&watch_mutex);
+
+	if (w->pending)
+		Free(w->pending);
+	if (w->idxs)
+		Free(w->idxs);
+	Free(w->out);
+	Free(w);
+}
+
+// Take w before answering a command on its connection, so that no update is
+// written while the reply is. A line the publisher left half sent is finished
+// first, so the reply starts on a line of its own.
+void watch_lock(watch_t* w)
+{
+	P(&w->mutex);
+	if (!w->dead && w->out_off < w->out_len && w->out_off > 0 && w->out[w->out_off - 1] != '\n')
+	{
+		char* nl = memchr(w->out + w->out_off, '\n', w->out_len - w->out_off);   // Every queued line ends in one
+		int n = nl - (w->out + w->out_off) + 1;
+
+		Rio_writen(w->fd, w->out + w->out_off, n);
+		w->out_off += n;
+	}
+}
+
+void watch_unlock(watch_t* w)
+{
+	V(&w->mutex);
+}
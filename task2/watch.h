@@ -0,0 +1,37 @@
+/*
+ * watch.h - push updates of changed instruments to subscribed connections
+ */
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+#include "csapp.h"
+
+#define WATCH_BUF 2048     // Bytes of updates queued per subscriber before it counts as lagging
+
+// Format the update line of the instrument at stock_idx into buf, return its length
+typedef int watch_format_t(int idx, char* buf);
+
+typedef struct watch {
+	int fd;                   // Connection the updates go to
+	sem_t mutex;              // Held by the connection's worker around a command, tried by the publisher
+	int all;                  // Watching every instrument
+	int* idxs;                // stock_idx of the instruments watched one by one
+	int nidxs, cap;
+	char* out;                // Update lines the socket has not taken yet, under mutex
+	int out_off, out_len;
+	unsigned long* pending;   // Publisher only: instruments changed while out was full, NULL if none
+	int backlog;              // Publisher only: on the backlog list
+	int dead;                 // A send failed, nothing more is queued
+} watch_t;
+
+void watch_init(int nstocks, watch_format_t* format);
+void watch_changed(int idx);
+
+watch_t* watch_new(int fd);
+void watch_add(watch_t* w, int idx);
+void watch_add_all(watch_t* w);
+void watch_close(watch_t* w);
+void watch_lock(watch_t* w);
+void watch_unlock(watch_t* w);
+
+#endif /* __WATCH_H__ */